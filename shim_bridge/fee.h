@@ -23,13 +23,26 @@
 #ifndef FEE_DOT_H
 #define FEE_DOT_H
 
+#include <linux/hrtimer.h>
+#include <linux/irq_work.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/pci.h>
+#include <linux/percpu.h>
 #include <linux/semaphore.h>
+#include <linux/uio.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include <genz_control.h>
 
+#include "gf_bridge_ioctl.h"		// Receive mmap layout
+
+#ifndef ITER_SOURCE
+#define ITER_SOURCE	WRITE		// Before 6.1
+#define ITER_DEST	READ
+#endif
+
 #define FEE_DEBUG			// See "Debug assistance" below
 
 #define FEE_NAME	"FEE"
@@ -62,6 +75,18 @@ struct FEE_globals {			// BAR 2: Start of IVSHMEM
 	uint64_t slotsize, buf_offset, nClients, nEvents, server_id;
 };
 
+// How BAR2 is mapped (insmod bar2_map), see mapBARs().  Under QEMU it's
+// all host RAM, coherent for plain loads and stores no matter what the
+// guest thinks it is.  Locked read-modify-writes are another matter, see
+// FEE_bar2_atomics().
+
+enum FEE_bar2_map {
+	FEE_BAR2_UC = 0,		// pci_iomap(), every access on its own
+	FEE_BAR2_WC,			// Stores gather until a fence
+	FEE_BAR2_WB,			// Cached, the usual barriers are enough
+	FEE_BAR2_NMAPS
+};
+
 // Use only uint64_t and keep the buf[] on a 32-byte alignment for this:
 // od -Ad -w32 -c -tx8 /dev/shm/ivshmsg_mailbox
 struct __attribute__ ((packed)) FEE_mailslot {
@@ -72,46 +97,428 @@ struct __attribute__ ((packed)) FEE_mailslot {
 		 last_responder,	// off 80: To assist stale stompage
 		 peer_SID,		// off 88: Calculated in MSI-X...
 		 peer_CID,		// off 96: ...from last_responder
-		 pad[3];		// off 104
+		 caps,			// off 104: FEE_CAP_xxx, 0 from Python
+		 ring_entries,		// off 112: FEE_CAP_TXRING geometry...
+		 ring_entsize;		// off 120: ...per struct FEE_ring_entry
 	char buf[];			// off 128 == globals->buf_offset
 };
 
+// Capabilities advertised by a driver in its own mailslot.  The Python
+// server (and older drivers) leave these fields zero and only speak the
+// single-message buflen handshake, so everything here is negotiated
+// per-peer by looking at the other guy's slot.
+
+#define FEE_CAP_TXRING		(1 << 0)	// Multi-entry send ring below
+#define FEE_CAP_RINGBACK	(1 << 1)	// Rings sender on release, and
+						// takes empty doorbells itself
+#define FEE_CAP_BINLINK		(1 << 2)	// Binary link-layer messages
+						// (genz_link_*_format) only
+#define FEE_CAP_FRAG		(1 << 3)	// Reassembles FEE_RING_FRAG
+#define FEE_CAP_CREDITS		(1 << 4)	// struct FEE_credit table below
+#define FEE_CAP_MGMT		(1 << 5)	// Management ring below, and
+						// claims those from others first
+#define FEE_CAP_MGMT_IRQ_BIT	6		// Takes them on a second vector
+#define FEE_CAP_MGMT_IRQ	(1 << FEE_CAP_MGMT_IRQ_BIT)
+
+// Not a capability but a hint in the same word: the owner is polling its
+// senders and a doorbell would only cost it an interrupt.  A sender that
+// sees it may skip ringing; the receiver rescans after clearing it.
+#define FEE_SLOT_NOTIFY_OFF_BIT	63
+#define FEE_SLOT_NOTIFY_OFF	(1ULL << FEE_SLOT_NOTIFY_OFF_BIT)
+
+// Bits of caps that change once interrupts are running do so from hard
+// and soft interrupt context on different CPUs: set_bit()/clear_bit() on
+// this, never |= or &= on the field.
+
+static inline unsigned long *FEE_slot_caps(struct FEE_mailslot *slot)
+{
+	return (unsigned long *)&slot->caps;
+}
+
+// The send ring lives in the back of the owner's buf[].  The front of
+// buf[] stays the legacy one-message area so the server still works.
+// Producers (any thread or IRQ on the owning VM) reserve an entry by
+// cmpxchg on a private head index; the receiver claims READY entries
+// addressed to it and hands them back by writing FREE.  "ticket" is the
+// reservation ordinal so a receiver can keep per-sender ordering.
+
+#define FEE_RING_FREE		0
+#define FEE_RING_FILLING	1	// Reserved, sender writing
+#define FEE_RING_READY		2	// Doorbell has been (or will be) rung
+#define FEE_RING_CLAIMED	3	// Receiver has it, sender can't recall
+
+#define FEE_RING_NO_TICKET	(1ULL << 32)	// Never matches a u32 index
+
+// Set in an entry's buflen when buf[] starts with a struct FEE_frag_hdr,
+// one piece of a message too big for any single entry (fee_frag.c).
+// Only ever sent to peers advertising FEE_CAP_FRAG.
+#define FEE_RING_FRAG		(1ULL << 63)
+
+// A second, small ring of the same entries just in front of the credit
+// table (or whatever else is at the back) carries link management, so
+// it never waits behind data.  Fixed geometry since the slot header has
+// no room for more.  Peers advertising FEE_CAP_MGMT_IRQ want its doorbell
+// on vector (sender's peer id + nEvents), one of the spare MSI-X vectors.
+#define FEE_MGMT_ENTRIES	4
+#define FEE_MGMT_ENTSIZE	256
+
+struct __attribute__ ((packed)) FEE_ring_entry {
+	uint64_t state,			// FEE_RING_xxxx
+		 buflen,
+		 peer_id,		// Destination
+		 ticket;		// Low 32 bits of reservation index
+	char buf[];			// 32-byte header keeps od happy
+};
+
+// Flow control.  Each driver keeps one of these per peer id in its own
+// buf[], right in front of the send ring (or at the very end without
+// one).  A sender may have at most the receiver's window of messages the
+// receiver hasn't released yet: my sent[B] - B's freed[me] < B's window[me].
+// Both counts only grow, and each side writes only its own table.
+struct __attribute__ ((packed)) FEE_credit {
+	uint64_t sent,			// By me, to that peer
+		 freed,			// That peer's, released by me
+		 window,		// How many of those may be unreleased
+		 pad;			// 32 bytes keeps od happy
+};
+
+// msg_id is the sender's, so reassembly is per (peer, msg_id).  Pieces
+// of one message go out from one thread, in order.
+struct __attribute__ ((packed)) FEE_frag_hdr {
+	uint64_t msg_id,
+		 offset,		// Of this piece's payload in the whole
+		 total;			// Length of the whole message
+};
+
+// Sender-side (private) bookkeeping for my own ring.
+struct FEE_ring {
+	atomic_t head, tail;		// Free-running, unsigned math
+	uint32_t nentries, entsize, max_buflen;
+	char *base;			// In my_slot->buf
+	u64 *sent_ns;			// Per entry, for the release histogram
+};
+
+// Receive descriptor.  While claimed from a sender it points into that
+// mailslot and writing 0 through *release hands the space back.  Once
+// copied into the adapter receive queue buf is local and release is NULL.
+struct FEE_link_op;
+
+struct FEE_rxmsg {
+	struct list_head lister;	// rxq_free or rxq_ready
+	uint64_t buflen, peer_id, peer_SID, peer_CID;
+	char *buf;
+	uint64_t cap;			// Most buf can hold where it was claimed
+	uint64_t *release;		// sender buflen or ring entry state
+	const struct FEE_link_op *link_op;	// Set by FEE_link_queue()
+	bool frag;			// Claimed entry had FEE_RING_FRAG
+	char *reasm;			// Reassembled buf, freed on release
+	bool mgmt;			// From a management ring, no credit
+	unsigned posted;		// rxq_prod when it went to the mapping
+};
+
+// An outgoing reservation from FEE_reserve_outgoing(): fill buf with
+// buflen bytes then FEE_commit_outgoing() or FEE_abort_outgoing().
+struct FEE_txmsg {
+	char *buf;
+	size_t buflen;
+	uint32_t peer_id, ticket;
+	struct FEE_ring_entry *entry;	// NULL == legacy area
+	bool frag;			// Commit with FEE_RING_FRAG
+	bool credit;			// Took one from the peer
+	bool mgmt;			// entry is in my mgmt_ring
+};
+
+// Per-peer state, indexed by IVSHMSG peer id.  Index 0 (globals) is never
+// a sender so its slot is NULL.  Each MSI-X vector is requested with its
+// own FEE_peer as context so the ISR knows the sender without looking.
+struct FEE_peer {
+	struct FEE_adapter *adapter;			// Backpointer for ISR
+	struct FEE_mailslot *slot;			// Sender's mailslot
+	uint16_t peer_id;
+	int irq;					// 0 == not requested
+	int mgmt_irq;					// Its FEE_CAP_MGMT_IRQ
+	struct kobject *kobj;				// fee_peers/NN in sysfs
+	struct list_head reasm;				// fee_frag.c worker only
+	unsigned nreasm;
+};
+
+// Per-CPU event counters, bumped lock-free from any context and summed
+// when read through sysfs (fee_sysfs.c).  The per-peer ones are an array
+// indexed by IVSHMSG peer id, the traffic to and from that peer.
+
+enum FEE_counter {
+	FEE_CNT_TX_MSGS,
+	FEE_CNT_TX_BYTES,
+	FEE_CNT_RX_MSGS,
+	FEE_CNT_RX_BYTES,
+	FEE_CNT_TX_STOMPS,		// Gave up on my busy legacy area
+	FEE_CNT_RX_DROPS,		// Bogus incoming, handed back unread
+	FEE_CNT_TX_TIMEOUTS,		// Any send space wait that timed out
+	FEE_CNT_TX_RESTARTS,		// -ERESTARTSYS retried by a caller
+	FEE_CNT_LINK_MSGS,		// Link requests answered in here
+	FEE_CNT_DOORBELLS,		// Rung, including ringbacks
+	FEE_CNT_DOORBELLS_SKIPPED,	// Receiver was polling
+	FEE_CNT_IRQS,
+	FEE_CNT_RX_POLLS,		// Receive timer runs
+	FEE_CNT_RX_REASM,		// Messages put back together
+	FEE_CNT_RX_REASM_DROPS,		// Pieces (or wholes) thrown away
+	FEE_CNT_TX_CREDIT_WAITS,	// Sends held (or refused) for credit
+	FEE_CNT_RX_MGMT,		// Off management rings, ahead of data
+	FEE_NR_COUNTERS
+};
+
+enum FEE_peer_counter {
+	FEE_PCNT_TX_MSGS,
+	FEE_PCNT_TX_BYTES,
+	FEE_PCNT_RX_MSGS,
+	FEE_PCNT_RX_BYTES,
+	FEE_NR_PEER_COUNTERS
+};
+
+struct FEE_stats {
+	u64 c[FEE_NR_COUNTERS];
+};
+
+struct FEE_peer_stats {
+	u64 c[FEE_NR_PEER_COUNTERS];
+};
+
+// Send-to-release latency, per CPU and per destination peer: from commit
+// (which rings the doorbell) until I notice the receiver handed the space
+// back.  Bucket b counts [2^(b-1), 2^b) nanoseconds, the last one is
+// everything longer.  Adapter totals are the sum over peers.
+
+#define FEE_LAT_BUCKETS		40		// Last one starts at ~4.6 min
+
+struct FEE_lat_hist {
+	u64 b[FEE_LAT_BUCKETS];
+};
+
+// Ping-pong benchmark run from debugfs, see fee_pingbench.c.  The
+// deliverer matches pongs from peer_id against it under match_lock.
+
+#define FEE_PINGBENCH_MAX	1000000		// Pings per run
+
+struct FEE_pingbench {
+	struct mutex run_lock;			// One run at a time
+	spinlock_t match_lock;
+	struct wait_queue_head wqh;		// Runner waits for pongs
+	bool running;
+	uint32_t peer_id, sent, rcvd;
+	u64 *sent_ns, *rtt_ns;			// sent[], rcvd[] of them
+	struct {				// Last finished run
+		int ret;
+		uint32_t peer_id, count, burst;
+		u64 min, avg, p50, p99, p999, elapsed_ns;
+	} result;
+};
+
+// Raw BAR2 copy speed through this adapter's mapping, see fee_bar2bench.c.
+
+#define FEE_BAR2BENCH_MAX	1000000		// Iterations per run
+
+struct FEE_bar2bench {
+	struct mutex run_lock;			// One run at a time
+	struct {				// Last finished run
+		int ret, bar2_map;
+		uint32_t bytes, count;
+		u64 write_ns, read_ns, hdr_ns;	// Whole loops
+	} result;
+};
+
 // The primary configuration/context data.
 struct FEE_adapter {
 	struct list_head lister;
 	atomic_t nr_users;				// User-space actors
-	struct pci_dev *pdev;				// Paranoid reverse ptr
+	struct pci_dev *pdev;				// NULL on loopback
+	struct device *dev;				// PCI or loopback's
 	int slot;					// pdev->devfn >> 3
-	uint64_t max_buflen;
+	uint64_t max_buflen;				// legacy area
 	uint16_t my_id;					// match ringer field
 	struct ivshmem_registers __iomem *regs;		// BAR0
-	struct FEE_globals __iomem *globals;		// BAR2
+	void __iomem *bar2;				// Globals + mailslots
+	int bar2_map;					// enum FEE_bar2_map
+	struct FEE_globals *globals;			// &globals_copy
+	struct FEE_globals globals_copy;		// BAR2 never changes them
 	struct FEE_mailslot *my_slot;			// indexed by my_id
-	void *IRQ_private;				// arch-dependent?
+	struct FEE_peer *peers;				// nEvents of them
+	int nvectors;					// 0 == no ISR setup
+	bool loopback;					// See fee_loop.c
+	struct irq_work loop_irq;			// Its "MSI-X"
+	unsigned long *loop_rung;			// by ringer peer id
+
+	struct FEE_ring *tx_ring;			// NULL == legacy only
+	struct FEE_credit *credits;			// In my_slot, or NULL
+	struct FEE_ring *mgmt_ring;			// NULL == all data
+	unsigned long legacy_busy;			// bit 0: my_slot->buf
+	u64 legacy_sent_ns;				// legacy_busy holder
+	uint32_t legacy_peer;				// ditto
+	struct wait_queue_head outgoing_wqh;		// space handed back
+	struct delayed_work outgoing_watch;		// for silent hand backs
+	unsigned long tx_wait_longest;			// jiffies, any sender
 
 	// Per-adapter handshaking between doorbell/mail delivery and a
-	// driver read().  Doorbell comes in and sets the pointer then
-	// issues a wakeup.  read() follows the pointer then sets it
-	// to NULL for next one.  Since reading is more of a one-to-many
-	// relationship this module can hold the one.
-
-	struct FEE_mailslot *incoming_slot;
+	// driver read().  Doorbell comes in and marks the sender pending.
+	// The deliverer copies the sender's message into a free receive
+	// queue entry, hands the sender's space straight back, queues the
+	// entry and issues a wakeup.  read() takes an entry off the ready
+	// list and releases it back to the free list when done.  When the
+	// queue is full, messages simply wait in the sender's slot/ring
+	// until release() kicks the deliverer again.  Any number of readers
+	// share the queue; they wait exclusively and get woken one per
+	// message, in arrival order.
+
+	// With the receive area mmap()ed the deliverer posts descriptors to
+	// rxq_ring instead of rxq_ready, and user space hands entries back
+	// by index.  rxq_area is vmalloc_user() so it can be mapped, read
+	// only: the kernel still parses what's in the buffers.
+
+	struct FEE_rxmsg *rxq;				// rxq_nbufs entries
+	void *rxq_area;					// rxq_ring + rxq_bufs
+	struct gf_bridge_rxring *rxq_ring;		// rxq_ndesc descriptors
+	char *rxq_bufs;					// rxq_nbufs * rxq_stride
+	unsigned rxq_stride, rxq_nbufs, rxq_ndesc, rxq_prod, rxq_cons;
+	unsigned rxq_nmgmt;				// Last ones, rxq_mgmt_free
+	size_t rxq_maplen;
+	unsigned long *rxq_user;			// Posted to the mapping
+	int rxq_mappers;				// VMAs, incoming_slot_lock
+	struct file *rxq_owner;				// That did the mmap()
+	struct list_head rxq_free, rxq_ready;		// incoming_slot_lock
+	struct list_head rxq_mgmt_free;			// ditto, data can't have
+	struct list_head rxq_link;			// ditto, for link_work
+	struct list_head rxq_frag;			// ditto, for frag_work
+	unsigned long *incoming_pending;		// bitmap of peer ids
+	unsigned long *mgmt_pending;			// ditto, served first
+	unsigned long *ringback_pending;		// ditto, deliverer only
+	unsigned long incoming_busy;			// bit 0: deliverer
+	unsigned incoming_rr;				// next peer to check
 	struct wait_queue_head incoming_slot_wqh;
 	spinlock_t incoming_slot_lock;
 
+	// NAPI-style polled receive.  The first doorbell sets NOTIFY_OFF in
+	// my slot and starts rx_poll_timer, which delivers up to rx_budget
+	// messages per run and keeps going while there's work.  It lingers
+	// a while after the last message, adapting to the load, before it
+	// turns doorbells back on.
+	unsigned long rx_polling;			// bit 0: timer owns rx
+	bool rx_poll_stopped;				// incoming_slot_lock
+	struct hrtimer rx_poll_timer;
+	u64 rx_linger_ns;				// timer only
+
+	// Busy-poll defaults for readers, set via sysfs (fee_sysfs.c).
+	unsigned busy_poll_usecs;			// 0 == off
+	int busy_poll_hybrid;				// sleep first
+	u64 busy_poll_ewma_ns;				// typical spin
+
+	// Link layer management (ping, Peer-Attribute, CTL-Write) gets
+	// pulled off the receive path and answered from process context.
+	struct workqueue_struct *link_wq;
+	struct work_struct link_work;
+
+	// Fragments (fee_frag.c) are copied off the receive path like any
+	// message and put back together in process context.
+	struct workqueue_struct *frag_wq;
+	struct work_struct frag_work;
+	atomic_t frag_msg_id;				// My next one
+	atomic64_t frag_bytes;				// Reassembly, all peers
+
 	// Writing is many to one, so support buffers etc are the
 	// responsibility of that module, managed by open() & release().
 	void *outgoing;
 
+	struct FEE_stats __percpu *stats;
+	struct FEE_peer_stats __percpu *peer_stats;	// nEvents of them
+	struct kobject *peers_kobj;			// fee_peers in sysfs
+	struct FEE_lat_hist __percpu *tx_lat;		// nEvents of them
+	struct dentry *debugfs;				// fee_debugfs.c
+	struct FEE_pingbench pingbench;
+	struct FEE_bar2bench bar2bench;
+
 	struct genz_core_structure *core;		// Primary data structure
 	struct genz_char_device *genz_chrdev;		// Convenience backpointers
 	void *teardown;
 };
 
+// Hand a claimed message back to its sender.  For a ring entry that's
+// FEE_RING_FREE, for the legacy area it's buflen == 0.  Write-combined
+// reads aren't ordered against stores, and the store has to get out of
+// the buffers for a sender that polls instead of waiting for ringback.
+
+static inline void FEE_rxmsg_done(struct FEE_adapter *adapter,
+				  struct FEE_rxmsg *msg)
+{
+	if (adapter->bar2_map != FEE_BAR2_WC) {
+		smp_store_release(msg->release, 0);
+		return;
+	}
+	mb();
+	WRITE_ONCE(*msg->release, 0);
+	wmb();
+}
+
+// After the last store of a message, so a receiver looking before (or
+// without) the doorbell sees it.  Only write combining holds stores back.
+
+static inline void FEE_bar2_publish(struct FEE_adapter *adapter)
+{
+	if (adapter->bar2_map == FEE_BAR2_WC)
+		wmb();
+}
+
+// Ring entry states, credit counters and caps bits are changed with
+// cmpxchg and atomic bitops, which the architecture only promises for
+// uncached BAR2 (or loopback's plain memory).  Anything else runs without
+// the send ring, credits, management channel and doorbell suppression.
+
+static inline bool FEE_bar2_atomics(struct FEE_adapter *adapter)
+{
+	return adapter->bar2_map == FEE_BAR2_UC || adapter->loopback;
+}
+
+// Receive queue entries go back to the pool they came from.
+
+static inline struct list_head *FEE_rxq_pool(struct FEE_adapter *adapter,
+					     struct FEE_rxmsg *msg)
+{
+	return msg - adapter->rxq >= adapter->rxq_nbufs - adapter->rxq_nmgmt ?
+		&adapter->rxq_mgmt_free : &adapter->rxq_free;
+}
+
+static inline void FEE_count(struct FEE_adapter *adapter,
+			     enum FEE_counter which, u64 n)
+{
+	this_cpu_add(adapter->stats->c[which], n);
+}
+
+static inline void FEE_count_tx(struct FEE_adapter *adapter,
+				uint32_t peer_id, u64 bytes)
+{
+	FEE_count(adapter, FEE_CNT_TX_MSGS, 1);
+	FEE_count(adapter, FEE_CNT_TX_BYTES, bytes);
+	this_cpu_add(adapter->peer_stats[peer_id].c[FEE_PCNT_TX_MSGS], 1);
+	this_cpu_add(adapter->peer_stats[peer_id].c[FEE_PCNT_TX_BYTES], bytes);
+}
+
+static inline void FEE_count_rx(struct FEE_adapter *adapter,
+				uint32_t peer_id, u64 bytes)
+{
+	FEE_count(adapter, FEE_CNT_RX_MSGS, 1);
+	FEE_count(adapter, FEE_CNT_RX_BYTES, bytes);
+	this_cpu_add(adapter->peer_stats[peer_id].c[FEE_PCNT_RX_MSGS], 1);
+	this_cpu_add(adapter->peer_stats[peer_id].c[FEE_PCNT_RX_BYTES], bytes);
+}
+
+static inline void FEE_lat_record(struct FEE_adapter *adapter,
+				  uint32_t peer_id, u64 ns)
+{
+	this_cpu_inc(adapter->tx_lat[peer_id].b[
+		min_t(unsigned, fls64(ns), FEE_LAT_BUCKETS - 1)]);
+}
+
 //-------------------------------------------------------------------------
 // fee_pci.c - insmod/rmmod handling with pci_register probe()/remove()
 
-extern int verbose;				// insmod parameter
+extern int verbose, bar2_map;			// insmod parameters
 extern struct list_head FEE_adapter_list;
 extern struct semaphore FEE_adapter_sema;
 
@@ -120,9 +527,13 @@ extern struct semaphore FEE_adapter_sema;
 
 // Linked in to genzfee.ko, used by various other source modules
 struct FEE_adapter *FEE_adapter_create(struct pci_dev *);
+struct FEE_adapter *FEE_adapter_create_loop(struct device *, int,
+	struct ivshmem_registers *, struct FEE_globals *);
 void FEE_adapter_destroy(struct FEE_adapter *);
 struct FEE_mailslot __iomem *calculate_mailslot(struct FEE_adapter *, unsigned);
 
+extern const char * const FEE_bar2_map_names[];	// By enum FEE_bar2_map
+
 // Nothing EXPORTed
 
 //.........................................................................
@@ -131,10 +542,49 @@ struct FEE_mailslot __iomem *calculate_mailslot(struct FEE_adapter *, unsigned);
 #define GENZ_FEE_SID_DEFAULT		27	// see twisted_server.py
 #define GENZ_FEE_SID_CID_IS_PEER_ID	-42	// interpret cid as peer_id
 
+static inline uint32_t FEE_peer_id(int CID, int SID)
+{
+	return SID == GENZ_FEE_SID_CID_IS_PEER_ID ? CID : CID / 100;
+}
+
+extern int ring_entries, rxq_depth, rx_credits,	// insmod parameters
+	   mgmt_channel;
+
+#define FEE_BUSY_POLL_MAX_USECS	10000		// Sanity, not policy
+
+int FEE_ring_init(struct FEE_adapter *);
+void FEE_ring_destroy(struct FEE_adapter *);
+int FEE_credit_init(struct FEE_adapter *);
+void FEE_credit_destroy(struct FEE_adapter *);
+void FEE_credit_free(struct FEE_adapter *, struct FEE_rxmsg *);
+int64_t FEE_credit_left(struct FEE_adapter *, uint32_t);
+int FEE_mgmt_init(struct FEE_adapter *);
+void FEE_mgmt_destroy(struct FEE_adapter *);
+void FEE_mgmt_irq_probe(struct FEE_adapter *);
+int FEE_rxq_init(struct FEE_adapter *);
+void FEE_rxq_destroy(struct FEE_adapter *);
+void FEE_mark_senders(struct FEE_adapter *);
+int FEE_deliver_budget(struct FEE_adapter *, int);
+void FEE_deliver_incoming(struct FEE_adapter *);
+void FEE_rxq_post(struct FEE_adapter *, struct FEE_rxmsg *);
+void FEE_outgoing_watch(struct work_struct *);
+void FEE_tx_harvest(struct FEE_adapter *);
+
 // EXPORTed
-extern struct FEE_mailslot *FEE_await_incoming(struct FEE_adapter *, int);
-extern void FEE_release_incoming(struct FEE_adapter *);
+extern struct FEE_rxmsg *FEE_await_incoming(struct FEE_adapter *, int);
+extern void FEE_release_incoming(struct FEE_adapter *, struct FEE_rxmsg *);
+extern int FEE_release_index(struct FEE_adapter *, unsigned);
+extern int FEE_rxq_mmap(struct FEE_adapter *, struct vm_area_struct *);
+extern bool FEE_busy_poll(struct FEE_adapter *, unsigned, int);
+extern bool FEE_incoming_ready(struct FEE_adapter *);
+extern bool FEE_outgoing_ready(struct FEE_adapter *);
 extern int FEE_create_outgoing(int, int, char *, size_t, struct FEE_adapter *);
+extern int FEE_create_mgmt(int, int, char *, size_t, struct FEE_adapter *);
+extern int FEE_reserve_outgoing(int, int, size_t, struct FEE_adapter *, int,
+				struct FEE_txmsg *);
+extern int FEE_commit_outgoing(struct FEE_adapter *, struct FEE_txmsg *, int);
+extern void FEE_doorbell(struct FEE_adapter *, uint32_t);
+extern void FEE_abort_outgoing(struct FEE_adapter *, struct FEE_txmsg *);
 
 //.........................................................................
 // FEE_???.c - handle interrupts from other FEE peers (input). By arch:
@@ -142,11 +592,90 @@ extern int FEE_create_outgoing(int, int, char *, size_t, struct FEE_adapter *);
 // ARM64:	FEE_MSI-X.c with assist from QEMU vfio modules
 // RISCV:	not written yet
 
-irqreturn_t FEE_link_request(struct FEE_mailslot __iomem *, struct FEE_adapter *);
+extern int rx_budget, rx_moder_usecs;		// insmod parameters
+
+int FEE_link_init(struct FEE_adapter *);
+void FEE_link_destroy(struct FEE_adapter *);
+bool FEE_link_queue(struct FEE_rxmsg *, struct FEE_adapter *);
+
+extern int frag_max_mb, frag_budget_mb;		// insmod parameters
+
+int FEE_frag_init(struct FEE_adapter *);
+void FEE_frag_destroy(struct FEE_adapter *);
+void FEE_frag_queue(struct FEE_rxmsg *, struct FEE_adapter *);
+
+// EXPORTed
+extern int FEE_frag_send(struct FEE_adapter *, int, int, struct iov_iter *,
+			 size_t, int);
+
+// A binary link message with that opcode?  buf may still be in the
+// sender's mailslot.
+
+static inline bool FEE_link_is(const char *buf, uint64_t buflen,
+			       uint8_t opcode)
+{
+	const struct genz_link_header_format *hdr = (const void *)buf;
+
+	return buflen >= sizeof(*hdr) && hdr->magic == GENZ_LINK_MAGIC &&
+	       hdr->opcode == opcode;
+}
+
+static inline void FEE_link_header(void *buf, uint8_t opcode)
+{
+	struct genz_link_header_format *hdr = buf;
+
+	hdr->magic = GENZ_LINK_MAGIC;
+	hdr->version = GENZ_LINK_VERSION;
+	hdr->opcode = opcode;
+	hdr->reserved = 0;
+}
 
 // EXPORTed
 int FEE_ISR_setup(struct pci_dev *);
 void FEE_ISR_teardown(struct pci_dev *);
+void FEE_rx_poll_kick(struct FEE_adapter *);
+
+int FEE_ISR_loop_setup(struct FEE_adapter *);
+void FEE_ISR_loop_teardown(struct FEE_adapter *);
+void FEE_ISR_loop_ring(struct FEE_adapter *, uint16_t);
+
+//.........................................................................
+// fee_loop.c - software IVSHMEM adapters all within this kernel
+
+extern int loopback_peers, loopback_slotsize;	// insmod parameters
+
+int FEE_loop_init(void);
+void FEE_loop_exit(void);
+void FEE_loop_doorbell(struct FEE_adapter *, uint32_t, uint16_t);
+
+//.........................................................................
+// fee_sysfs.c - per-adapter attributes under the PCI (or loopback) device
+
+int FEE_sysfs_init(struct FEE_adapter *);
+void FEE_sysfs_destroy(struct FEE_adapter *);
+
+//.........................................................................
+// fee_debugfs.c - per-adapter histograms etc under debugfs
+
+extern struct dentry *FEE_debugfs_root;
+
+void FEE_debugfs_init(struct FEE_adapter *);
+void FEE_debugfs_destroy(struct FEE_adapter *);
+
+//.........................................................................
+// fee_pingbench.c - round trips against the link layer "ping" handler
+
+extern const struct file_operations FEE_pingbench_fops;
+
+void FEE_pingbench_init(struct FEE_adapter *);
+bool FEE_pingbench_pong(struct FEE_adapter *, struct FEE_rxmsg *);
+
+//.........................................................................
+// fee_bar2bench.c - memcpy to and from BAR2 as mapped
+
+extern const struct file_operations FEE_bar2bench_fops;
+
+void FEE_bar2bench_init(struct FEE_adapter *);
 
 //.........................................................................
 // fee_register.c - accept end-driver requests to use FEE.
@@ -162,7 +691,7 @@ extern int FEE_unregister(const struct file_operations *);
 // Legibility assistance
 
 // Send a command for the switch interpreter
-#define UPDATE_SWITCH(AdApTeR) FEE_create_outgoing( \
+#define UPDATE_SWITCH(AdApTeR) FEE_create_mgmt( \
 			AdApTeR->globals->server_id, \
 			GENZ_FEE_SID_CID_IS_PEER_ID, \
 			"dump", 4, AdApTeR);
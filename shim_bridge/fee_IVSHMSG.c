@@ -20,42 +20,762 @@
 
 // Implement the mailbox/mailslot protocol of IVSHMSG.
 
+#include <linux/bitops.h>
 #include <linux/delay.h>	// usleep_range, wait_event*
 #include <linux/export.h>
 #include <linux/jiffies.h>	// jiffies
+#include <linux/ktime.h>	// busy-poll deadline
+#include <linux/log2.h>
+#include <linux/mm.h>		// vm_area_struct
+#include <linux/sched/signal.h>	// signal_pending
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>	// vmalloc_user, remap_vmalloc_range
+#include <linux/workqueue.h>
 
 #include "fee.h"
+#include "fee_trace.h"
 
 //-------------------------------------------------------------------------
-// Return positive (bytecount) on success, negative on error, never 0.
-// The synchronous rate seems to be determined mostly by the sleep 
-// duration. I tried a 3x timeout whose success varied from 2 minutes to
-// three hours before it popped. 4x was better, lasted until I did a
-// compile, so...use a slightly adaptive timeout to reach the LOOP_MAX.
-// CID,SID is the order used in the spec.
+// Carve a send ring out of the back of my_slot->buf.  Slots too small to
+// hold at least a useful payload per entry just run the original single-
+// message protocol, as does any peer that doesn't advertise FEE_CAP_TXRING.
+
+#define FEE_RING_MIN_PAYLOAD	64
+
+static inline uint64_t slot_buflen(struct FEE_adapter *adapter)
+{
+	return adapter->globals->slotsize - adapter->globals->buf_offset;
+}
+
+static inline struct FEE_ring_entry *ring_entry(struct FEE_ring *ring,
+						uint32_t index)
+{
+	return (void *)(ring->base +
+		(index & (ring->nentries - 1)) * ring->entsize);
+}
+
+// Used for the management ring too.
+
+static struct FEE_ring *ring_create(char *base, uint32_t nentries,
+				    uint32_t entsize)
+{
+	struct FEE_ring *ring;
+	uint32_t i;
+
+	if (!(ring = kzalloc(sizeof(*ring), GFP_KERNEL)))
+		return NULL;
+	if (!(ring->sent_ns = kcalloc(nentries, sizeof(u64), GFP_KERNEL))) {
+		kfree(ring);
+		return NULL;
+	}
+	ring->nentries = nentries;
+	ring->entsize = entsize;
+	ring->max_buflen = entsize - sizeof(struct FEE_ring_entry) - 1; // NUL
+	ring->base = base;
+	for (i = 0; i < nentries; i++) {
+		struct FEE_ring_entry *entry = ring_entry(ring, i);
+
+		entry->state = FEE_RING_FREE;
+		entry->ticket = FEE_RING_NO_TICKET;
+	}
+	return ring;
+}
+
+static void ring_free(struct FEE_ring *ring)
+{
+	if (ring)
+		kfree(ring->sent_ns);
+	kfree(ring);
+}
+
+int FEE_ring_init(struct FEE_adapter *adapter)
+{
+	struct FEE_ring *ring;
+	uint64_t whole = slot_buflen(adapter), nentries, entsize;
+
+	adapter->max_buflen = whole;
+	if (ring_entries < 2)
+		return 0;
+	if (!FEE_bar2_atomics(adapter)) {
+		pr_info(FEESP "no send ring, credits or management on %s BAR2\n",
+			FEE_bar2_map_names[adapter->bar2_map]);
+		return 0;
+	}
+	nentries = rounddown_pow_of_two(ring_entries);	// cheap wrap math
+	entsize = round_down(whole / 2 / nentries, 32);
+	if (entsize < sizeof(struct FEE_ring_entry) + FEE_RING_MIN_PAYLOAD) {
+		pr_info(FEESP "%llu-byte slots too small for a %llu-entry ring\n",
+			adapter->globals->slotsize, nentries);
+		return 0;
+	}
+	if (!(ring = ring_create(adapter->my_slot->buf + whole -
+				 nentries * entsize, nentries, entsize)))
+		return -ENOMEM;
+	adapter->max_buflen = whole - nentries * entsize;
+	adapter->tx_ring = ring;
+
+	// Geometry must be visible before anyone believes the capability.
+	adapter->my_slot->ring_entries = nentries;
+	adapter->my_slot->ring_entsize = entsize;
+	wmb();
+	adapter->my_slot->caps |= FEE_CAP_TXRING;
+	PR_V1(FEESP "send ring %llu x %llu bytes, legacy max_buflen %llu\n",
+		nentries, entsize, adapter->max_buflen);
+	return 0;
+}
+
+void FEE_ring_destroy(struct FEE_adapter *adapter)
+{
+	if (adapter->globals && adapter->my_slot)
+		adapter->my_slot->caps &= ~FEE_CAP_TXRING;
+	ring_free(adapter->tx_ring);
+	adapter->tx_ring = NULL;
+}
+
+//-------------------------------------------------------------------------
+// Flow control credits, see struct FEE_credit.  A peer's table sits just
+// in front of its send ring.  Peers that don't advertise FEE_CAP_CREDITS
+// (the server, older drivers) take whatever they're sent, as before.
+
+static struct FEE_credit *credit_table(struct FEE_adapter *adapter,
+				       struct FEE_mailslot *slot)
+{
+	uint64_t caps = READ_ONCE(slot->caps), whole = slot_buflen(adapter),
+		 size = adapter->globals->nEvents * sizeof(struct FEE_credit),
+		 ringsize = 0;
+
+	if (!(caps & FEE_CAP_CREDITS))
+		return NULL;
+	if (caps & FEE_CAP_TXRING)
+		ringsize = slot->ring_entries * slot->ring_entsize;
+	if (ringsize + size > whole)
+		return NULL;
+	return (void *)(slot->buf + whole - ringsize - size);
+}
+
+// The entry peer_id keeps about me, if it keeps one and so do I.
+
+static struct FEE_credit *credit_theirs(struct FEE_adapter *adapter,
+					uint64_t peer_id)
+{
+	struct FEE_credit *table;
+
+	if (!adapter->credits || peer_id >= adapter->globals->nEvents ||
+	    !adapter->peers[peer_id].slot ||
+	    !(table = credit_table(adapter, adapter->peers[peer_id].slot)))
+		return NULL;
+	return &table[adapter->my_id];
+}
+
+// After FEE_rxq_init(): by default the window splits the receive queue
+// between the clients.  Counts pick up where an earlier life of either
+// side left off, so reloading one end doesn't wedge the other.
+
+int FEE_credit_init(struct FEE_adapter *adapter)
+{
+	uint64_t nEvents = adapter->globals->nEvents, window, i,
+		 size = nEvents * sizeof(struct FEE_credit);
+	struct FEE_credit *theirs;
+
+	if (rx_credits < 0 || !FEE_bar2_atomics(adapter))
+		return 0;
+	if (adapter->max_buflen < size + FEE_RING_MIN_PAYLOAD) {
+		pr_info(FEESP "%llu-byte slots too small for flow control\n",
+			adapter->globals->slotsize);
+		return 0;
+	}
+	window = rx_credits ? rx_credits :
+		 max_t(uint64_t, 1, (adapter->rxq_nbufs - adapter->rxq_nmgmt) /
+				    max_t(uint64_t, 1, adapter->globals->nClients));
+	adapter->max_buflen -= size;
+	adapter->credits = (void *)(adapter->my_slot->buf + adapter->max_buflen);
+	memset(adapter->credits, 0, size);
+	for (i = 0; i < nEvents; i++) {
+		adapter->credits[i].window = window;
+		if ((theirs = credit_theirs(adapter, i))) {
+			adapter->credits[i].sent = READ_ONCE(theirs->freed);
+			adapter->credits[i].freed = READ_ONCE(theirs->sent);
+		}
+	}
+	wmb();
+	adapter->my_slot->caps |= FEE_CAP_CREDITS;
+	PR_V1(FEESP "%llu receive credits per sender, legacy max_buflen %llu\n",
+		window, adapter->max_buflen);
+	return 0;
+}
+
+void FEE_credit_destroy(struct FEE_adapter *adapter)
+{
+	if (adapter->globals && adapter->my_slot)
+		adapter->my_slot->caps &= ~FEE_CAP_CREDITS;
+	adapter->credits = NULL;
+}
+
+// Sends left to peer_id, or -1 if it doesn't count them.
+
+int64_t FEE_credit_left(struct FEE_adapter *adapter, uint32_t peer_id)
+{
+	struct FEE_credit *theirs = credit_theirs(adapter, peer_id);
+	uint64_t used, window;
+
+	if (!theirs)
+		return -1;
+	window = READ_ONCE(theirs->window);
+	used = READ_ONCE(adapter->credits[peer_id].sent) -
+	       READ_ONCE(theirs->freed);
+	return used < window ? window - used : 0;
+}
+
+// 1 if I took one, 0 if peer_id doesn't count, -EAGAIN if there's none.
+
+static int credit_take(struct FEE_adapter *adapter, uint32_t peer_id)
+{
+	struct FEE_credit *theirs = credit_theirs(adapter, peer_id);
+	uint64_t *sent, old;
+
+	if (!theirs)
+		return 0;
+	sent = &adapter->credits[peer_id].sent;
+	do {
+		old = READ_ONCE(*sent);
+		if (old - READ_ONCE(theirs->freed) >= READ_ONCE(theirs->window))
+			return -EAGAIN;
+	} while (cmpxchg(sent, old, old + 1) != old);
+	return 1;
+}
+
+// For a message that never got to the peer after all.
+
+static void credit_return(struct FEE_adapter *adapter, uint32_t peer_id)
+{
+	uint64_t *sent = &adapter->credits[peer_id].sent, old;
+
+	do {
+		old = READ_ONCE(*sent);
+	} while (cmpxchg(sent, old, old - 1) != old);
+}
+
+//-------------------------------------------------------------------------
+// The management channel, see FEE_MGMT_ENTRIES.  After FEE_credit_init()
+// so it lands in front of the table.  Messages on it take no credit: the
+// ring itself bounds them, and the receiver keeps rxq_nmgmt queue entries
+// that data can't use.
+
+#define FEE_MGMT_SIZE	(FEE_MGMT_ENTRIES * FEE_MGMT_ENTSIZE)
+
+static char *mgmt_ring_base(struct FEE_adapter *adapter,
+			    struct FEE_mailslot *slot)
+{
+	uint64_t caps = READ_ONCE(slot->caps), whole = slot_buflen(adapter),
+		 back = FEE_MGMT_SIZE;
+
+	if (!(caps & FEE_CAP_MGMT))
+		return NULL;
+	if (caps & FEE_CAP_TXRING)
+		back += slot->ring_entries * slot->ring_entsize;
+	if (caps & FEE_CAP_CREDITS)
+		back += adapter->globals->nEvents * sizeof(struct FEE_credit);
+	return back > whole ? NULL : slot->buf + whole - back;
+}
+
+int FEE_mgmt_init(struct FEE_adapter *adapter)
+{
+	if (!mgmt_channel || !FEE_bar2_atomics(adapter))
+		return 0;
+	if (adapter->max_buflen < FEE_MGMT_SIZE + FEE_RING_MIN_PAYLOAD) {
+		pr_info(FEESP "%llu-byte slots too small for a management ring\n",
+			adapter->globals->slotsize);
+		return 0;
+	}
+	if (!(adapter->mgmt_ring = ring_create(
+			adapter->my_slot->buf + adapter->max_buflen - FEE_MGMT_SIZE,
+			FEE_MGMT_ENTRIES, FEE_MGMT_ENTSIZE)))
+		return -ENOMEM;
+	adapter->max_buflen -= FEE_MGMT_SIZE;
+	wmb();
+	adapter->my_slot->caps |= FEE_CAP_MGMT;
+	PR_V1(FEESP "management ring %d x %d bytes, legacy max_buflen %llu\n",
+		FEE_MGMT_ENTRIES, FEE_MGMT_ENTSIZE, adapter->max_buflen);
+	return 0;
+}
+
+void FEE_mgmt_destroy(struct FEE_adapter *adapter)
+{
+	if (adapter->globals && adapter->my_slot)
+		adapter->my_slot->caps &= ~(FEE_CAP_MGMT | FEE_CAP_MGMT_IRQ);
+	ring_free(adapter->mgmt_ring);
+	adapter->mgmt_ring = NULL;
+}
+
+//-------------------------------------------------------------------------
+// Send-to-release latency.  The committer stamps sent_ns before it writes
+// the entry (peer_id included), and whoever first sees the entry handed
+// back takes the stamp with cmpxchg, so each send is counted once without
+// a lock.  A stamp overwritten by the next use of the entry makes the
+// cmpxchg fail, so a peer_id read after the stamp always goes with it.
+
+static inline u64 *ring_sent(struct FEE_ring *ring, uint32_t index)
+{
+	return &ring->sent_ns[index & (ring->nentries - 1)];
+}
+
+static void ring_harvest(struct FEE_adapter *adapter, struct FEE_ring *ring,
+			 uint32_t index)
+{
+	struct FEE_ring_entry *entry = ring_entry(ring, index);
+	u64 sent = READ_ONCE(*ring_sent(ring, index));
+	uint64_t peer_id;
+
+	if (!sent)
+		return;
+	smp_rmb();
+	if (entry->state != FEE_RING_FREE || entry->ticket != index)
+		return;
+	peer_id = entry->peer_id;
+	if (peer_id < adapter->globals->nEvents &&
+	    cmpxchg(ring_sent(ring, index), sent, 0) == sent)
+		FEE_lat_record(adapter, peer_id, ktime_get_ns() - sent);
+}
+
+//-------------------------------------------------------------------------
+// Advance tail over entries the receivers have handed back.  Any number of
+// producers may do this at once; cmpxchg failure means someone else did.
+// The ticket check keeps a just-reserved (still FREE) entry from being
+// mistaken for a released one.  Harvest before the entry can be reused.
+
+static void ring_reclaim(struct FEE_adapter *adapter, struct FEE_ring *ring)
+{
+	struct FEE_ring_entry *entry;
+	uint32_t tail;
+
+	while ((tail = atomic_read(&ring->tail)) != atomic_read(&ring->head)) {
+		entry = ring_entry(ring, tail);
+		if (entry->state != FEE_RING_FREE || entry->ticket != tail)
+			break;
+		ring_harvest(adapter, ring, tail);
+		atomic_cmpxchg(&ring->tail, tail, tail + 1);
+	}
+}
+
+// Lock-free reservation.  Tail only moves forward so a stale read of it
+// can only make the ring look fuller than it is.
+
+static struct FEE_ring_entry *ring_reserve(struct FEE_ring *ring,
+					   uint32_t *ticket)
+{
+	struct FEE_ring_entry *entry;
+	uint32_t head;
+
+	do {
+		head = atomic_read(&ring->head);
+		if (head - (uint32_t)atomic_read(&ring->tail) >= ring->nentries)
+			return NULL;
+	} while (atomic_cmpxchg(&ring->head, head, head + 1) != head);
+	entry = ring_entry(ring, head);
+	entry->state = FEE_RING_FILLING;
+	*ticket = head;
+	return entry;
+}
+
+// A receiver that died (or never reads) would pin the tail forever.
+// Pull back the oldest entry if it hasn't been claimed yet.  Only data
+// took credit.
+
+static void ring_recall(struct FEE_adapter *adapter, struct FEE_ring *ring)
+{
+	uint32_t tail = atomic_read(&ring->tail);
+	struct FEE_ring_entry *entry = ring_entry(ring, tail);
+
+	if (cmpxchg(&entry->state, FEE_RING_READY, FEE_RING_FREE) ==
+	    FEE_RING_READY) {
+		WRITE_ONCE(*ring_sent(ring, tail), 0);	// Never released
+		if (ring == adapter->tx_ring &&
+		    credit_theirs(adapter, entry->peer_id))
+			credit_return(adapter, entry->peer_id);
+		pr_err(FEE "recalled unclaimed message to %llu\n",
+			entry->peer_id);
+	}
+	ring_reclaim(adapter, ring);
+}
+
+//-------------------------------------------------------------------------
+// Pseudo-"HW ready" predicates for await_hw_ready().  They're evaluated
+// inside wait_event so they must not claim anything; the callers do that.
+
+static bool legacy_slot_free(struct FEE_adapter *adapter)
+{
+	return !adapter->my_slot->buflen &&
+	       !test_bit(0, &adapter->legacy_busy);
+}
+
+static bool ring_space(struct FEE_adapter *adapter, struct FEE_ring *ring)
+{
+	ring_reclaim(adapter, ring);
+	return (uint32_t)atomic_read(&ring->head) -
+	       (uint32_t)atomic_read(&ring->tail) < ring->nentries;
+}
+
+static bool ring_has_space(struct FEE_adapter *adapter)
+{
+	return ring_space(adapter, adapter->tx_ring);
+}
+
+static bool mgmt_has_space(struct FEE_adapter *adapter)
+{
+	return ring_space(adapter, adapter->mgmt_ring);
+}
+
+// The legacy area has one stamp, guarded by legacy_busy like the area.
+
+static void legacy_harvest(struct FEE_adapter *adapter)
+{
+	if (adapter->legacy_sent_ns && !adapter->my_slot->buflen) {
+		FEE_lat_record(adapter, adapter->legacy_peer,
+			       ktime_get_ns() - adapter->legacy_sent_ns);
+		adapter->legacy_sent_ns = 0;
+	}
+}
+
+// True means the caller now owns my_slot->buf.  buflen must be rechecked
+// after winning the bit since another local sender may have just used it.
+
+static bool legacy_slot_claim(struct FEE_adapter *adapter)
+{
+	if (test_and_set_bit_lock(0, &adapter->legacy_busy))
+		return false;
+	if (!adapter->my_slot->buflen) {
+		legacy_harvest(adapter);
+		return true;
+	}
+	clear_bit_unlock(0, &adapter->legacy_busy);
+	return false;
+}
 
 #define PRIOR_RESP_WAIT		(5 * HZ)	// 5x
-#define DELAY_MS_LOOP_MAX	10		// or about 100 writes/second
+#define DELAY_MS_LOOP_MAX	10		// legacy: about 100 writes/second
+
+//-------------------------------------------------------------------------
+// For poll(): could a send go out right now?  A peer that never rings back
+// (the Python server) hands my legacy area back silently, so while anyone
+// waits on outgoing_wqh, outgoing_watch looks on their behalf.
 
-static unsigned long longest = PRIOR_RESP_WAIT/2;
+#define OUTGOING_WATCH_DELAY	max(1UL, msecs_to_jiffies(DELAY_MS_LOOP_MAX))
 
-int FEE_create_outgoing(int CID, int SID, char *buf, size_t buflen,
-			  struct FEE_adapter *adapter)
+static bool outgoing_ready(struct FEE_adapter *adapter)
 {
-	uint32_t peer_id;
-	unsigned long now = 0, this_delay,
-		 hw_timeout = get_jiffies_64() + PRIOR_RESP_WAIT;
+	return legacy_slot_free(adapter) ||
+	       (adapter->tx_ring && ring_has_space(adapter));
+}
+
+void FEE_outgoing_watch(struct work_struct *work)
+{
+	struct FEE_adapter *adapter = container_of(
+		to_delayed_work(work), struct FEE_adapter, outgoing_watch);
+
+	FEE_tx_harvest(adapter);
+	if (outgoing_ready(adapter))
+		wake_up(&adapter->outgoing_wqh);
+	else if (wq_has_sleeper(&adapter->outgoing_wqh))
+		schedule_delayed_work(&adapter->outgoing_watch,
+				      OUTGOING_WATCH_DELAY);
+}
+
+// Called when a peer may have handed space back (its doorbell, the watch)
+// so release times are taken close to when they happen.  Not finding the
+// legacy area free is fine: its owner will harvest it.  Callers wake
+// outgoing_wqh afterwards as they always did.
 
-	// The IVSHMEM "vector" will map to an MSI-X "entry" value.  "vector"
-	// is the lower 16 bits and the combo must be assigned atomically.
+static void ring_harvest_all(struct FEE_adapter *adapter, struct FEE_ring *ring)
+{
+	uint32_t i, head;
+
+	if (!ring)
+		return;
+	head = atomic_read(&ring->head);
+	for (i = atomic_read(&ring->tail); i != head; i++)
+		ring_harvest(adapter, ring, i);	// Out of order ones too
+	ring_reclaim(adapter, ring);
+}
+
+void FEE_tx_harvest(struct FEE_adapter *adapter)
+{
+	if (!test_and_set_bit_lock(0, &adapter->legacy_busy)) {
+		legacy_harvest(adapter);
+		clear_bit_unlock(0, &adapter->legacy_busy);
+	}
+	ring_harvest_all(adapter, adapter->tx_ring);
+	ring_harvest_all(adapter, adapter->mgmt_ring);
+}
+
+bool FEE_outgoing_ready(struct FEE_adapter *adapter)
+{
+	if (outgoing_ready(adapter))
+		return true;
+	schedule_delayed_work(&adapter->outgoing_watch, OUTGOING_WATCH_DELAY);
+	return false;
+}
+EXPORT_SYMBOL(FEE_outgoing_ready);
+
+//-------------------------------------------------------------------------
+// Peers advertising FEE_CAP_RINGBACK ring my doorbell when they hand my
+// space back, which wakes outgoing_wqh from the ISR within microseconds.
+// The Python server never does, so the sleep is still bounded by the old
+// adaptive delay: ringback peers cut it short, everyone else gets polled.
+// Link replies come from a workqueue so every caller can sleep.
+
+static int await_hw_ready(struct FEE_adapter *adapter,
+			  bool (*ready)(struct FEE_adapter *))
+{
+	unsigned long now, this_delay = 1,
+		 start = get_jiffies_64(),
+		 hw_timeout = start + PRIOR_RESP_WAIT;
+
+	might_sleep();
+	while (!ready(adapter)) {
+		now = get_jiffies_64();
+		if (!time_before(now, hw_timeout)) {
+			FEE_count(adapter, FEE_CNT_TX_TIMEOUTS, 1);
+			return -ERESTARTSYS;
+		}
+		wait_event_timeout(adapter->outgoing_wqh,
+				   ready(adapter),
+				   msecs_to_jiffies(this_delay));
+		if (this_delay < DELAY_MS_LOOP_MAX)
+			this_delay += 2;
+	}
+	if ((now = get_jiffies_64() - start) > adapter->tx_wait_longest)
+		WRITE_ONCE(adapter->tx_wait_longest, now);	// Racy, close enough
+	return 0;
+}
+
+//-------------------------------------------------------------------------
+// The IVSHMEM "vector" will map to an MSI-X "entry" value.  "vector"
+// is the lower 16 bits and the combo must be assigned atomically.
+
+static void ring_doorbell_vector(struct FEE_adapter *adapter, uint32_t peer_id,
+				 uint16_t vector)
+{
 	union __attribute__ ((packed)) {
 		struct { uint16_t vector, peer; };
 		uint32_t Doorbell;
 	} ringer;
 
-	peer_id = SID == GENZ_FEE_SID_CID_IS_PEER_ID ? CID : CID / 100;
+	ringer.peer = peer_id;
+	ringer.vector = vector;
+	wmb();			// Mailslot contents before the interrupt
+	adapter->regs->Doorbell = ringer.Doorbell;
+	if (adapter->loopback)	// Nobody watches that register
+		FEE_loop_doorbell(adapter, peer_id, vector);
+	FEE_count(adapter, FEE_CNT_DOORBELLS, 1);
+	trace_fee_doorbell(adapter, peer_id, false);
+}
+
+// Choose the correct vector set from all sent to me via the peer.
+// Trigger the vector corresponding to me with the vector.
+
+static void ring_doorbell(struct FEE_adapter *adapter, uint32_t peer_id)
+{
+	ring_doorbell_vector(adapter, peer_id, adapter->my_id);
+}
+
+// Management always rings, on its own vector if the peer has one.  The
+// receiver serves it first however it finds out.
+
+static void ring_doorbell_mgmt(struct FEE_adapter *adapter, uint32_t peer_id)
+{
+	struct FEE_mailslot *dest = adapter->peers[peer_id].slot;
+
+	ring_doorbell_vector(adapter, peer_id, adapter->my_id +
+		(READ_ONCE(dest->caps) & FEE_CAP_MGMT_IRQ ?
+		 adapter->globals->nEvents : 0));
+}
+
+// QEMU only delivers a vector the ivshmem server handed out an eventfd
+// for, which may be fewer than MSI-X has.  Ring my own management vector
+// and advertise FEE_CAP_MGMT_IRQ only when it shows up.
+
+void FEE_mgmt_irq_probe(struct FEE_adapter *adapter)
+{
+	ring_doorbell_vector(adapter, adapter->my_id,
+			     adapter->my_id + adapter->globals->nEvents);
+}
+
+// Message doorbells can be skipped while the receiver is polling.  The
+// full barrier pairs with the one after it clears FEE_SLOT_NOTIFY_OFF:
+// either it sees my message on its rescan or I see the flag clear.
+
+static void ring_doorbell_notify(struct FEE_adapter *adapter, uint32_t peer_id)
+{
+	struct FEE_mailslot *dest = NULL;
+
+	smp_mb();
+	if (peer_id < adapter->globals->nEvents)
+		dest = adapter->peers[peer_id].slot;
+	if (dest && (READ_ONCE(dest->caps) & FEE_SLOT_NOTIFY_OFF)) {
+		FEE_count(adapter, FEE_CNT_DOORBELLS_SKIPPED, 1);
+		trace_fee_doorbell(adapter, peer_id, true);
+		return;
+	}
+	ring_doorbell(adapter, peer_id);
+}
+
+// Receiver side: msg was released (or dropped) here.  A sender that
+// might be out of credit gets rung; any doorbell wakes its waiters.
+// Management never took any.  Safe from any context.
+
+void FEE_credit_free(struct FEE_adapter *adapter, struct FEE_rxmsg *msg)
+{
+	uint64_t peer_id = msg->peer_id, old;
+	struct FEE_credit *mine, *theirs;
+
+	if (!adapter->credits || msg->mgmt ||
+	    peer_id >= adapter->globals->nEvents)
+		return;
+	mine = &adapter->credits[peer_id];
+	do {
+		old = READ_ONCE(mine->freed);
+	} while (cmpxchg(&mine->freed, old, old + 1) != old);
+	if ((theirs = credit_theirs(adapter, peer_id)) &&
+	    READ_ONCE(theirs->sent) - old >= READ_ONCE(mine->window) &&
+	    (adapter->peers[peer_id].slot->caps & FEE_CAP_RINGBACK))
+		ring_doorbell(adapter, peer_id);
+}
+
+//-------------------------------------------------------------------------
+// Sending is reserve, fill, commit so callers (like the bridge write_iter)
+// can assemble a message straight into the outgoing space, no bounce
+// buffer.  A reservation holds either my legacy area or one ring entry.
+// Keep reserve-to-commit short, other local senders may be waiting on it.
+
+static int legacy_reserve(struct FEE_adapter *adapter, int nonblocking)
+{
+	// Wait until my_slot has pushed a previous write through. In truth
+	// it's the previous responder clearing my buflen.
+	// Giving up counts as a stomp: the previous message was never taken.
+	while (!legacy_slot_claim(adapter)) {
+		if (nonblocking)
+			return -EAGAIN;
+		if (await_hw_ready(adapter, legacy_slot_free)) {
+			FEE_count(adapter, FEE_CNT_TX_STOMPS, 1);
+			pr_err("%s() would stomp previous message to %llu\n",
+				__FUNCTION__, adapter->my_slot->last_responder);
+			return -ERESTARTSYS;
+		}
+	}
+	return 0;
+}
+
+// Like await_hw_ready() but for one peer's credit.  Its ring from
+// FEE_credit_free() wakes outgoing_wqh; the timeout covers the rest.
+
+static int credit_wait(struct FEE_adapter *adapter, int nonblocking,
+		       struct FEE_txmsg *tx)
+{
+	unsigned long hw_timeout = get_jiffies_64() + PRIOR_RESP_WAIT;
+	int ret;
+
+	if ((ret = credit_take(adapter, tx->peer_id)) < 0) {
+		FEE_count(adapter, FEE_CNT_TX_CREDIT_WAITS, 1);
+		if (nonblocking)
+			return -EAGAIN;
+		might_sleep();
+	}
+	while (ret < 0) {
+		if (!time_before(get_jiffies_64(), hw_timeout)) {
+			FEE_count(adapter, FEE_CNT_TX_TIMEOUTS, 1);
+			return -ERESTARTSYS;
+		}
+		wait_event_timeout(adapter->outgoing_wqh,
+				   FEE_credit_left(adapter, tx->peer_id),
+				   msecs_to_jiffies(DELAY_MS_LOOP_MAX));
+		ret = credit_take(adapter, tx->peer_id);
+	}
+	tx->credit = ret;
+	return 0;
+}
+
+// A legacy message to a ring peer is claimed ahead of anything in my
+// ring (see claim_from_peer()), so it must not go out while an older
+// entry to that peer is unclaimed.  A FILLING entry hasn't said where
+// it's going yet, so it counts whatever its destination.
+
+static bool ring_pending_to(struct FEE_ring *ring, uint64_t peer_id,
+			    uint32_t before)
+{
+	struct FEE_ring_entry *entry;
+	uint64_t state;
+	uint32_t i;
+
+	for (i = atomic_read(&ring->tail); (int32_t)(i - before) < 0; i++) {
+		entry = ring_entry(ring, i);
+		state = READ_ONCE(entry->state);
+		if (state == FEE_RING_FILLING ||
+		    (state == FEE_RING_READY && entry->ticket == i &&
+		     entry->peer_id == peer_id))
+			return true;
+	}
+	return false;
+}
+
+// Only what was reserved before this call: later sends to the same peer
+// can't hold a legacy sender off forever.  Claims hand back with a
+// ringback, which wakes outgoing_wqh; the timeout covers the rest.
+
+static int ring_drain_wait(struct FEE_adapter *adapter, uint64_t peer_id,
+			   int nonblocking)
+{
+	struct FEE_ring *ring = adapter->tx_ring;
+	unsigned long hw_timeout = get_jiffies_64() + PRIOR_RESP_WAIT;
+	uint32_t before = atomic_read(&ring->head);
+
+	if (!ring_pending_to(ring, peer_id, before))
+		return 0;
+	if (nonblocking)
+		return -EAGAIN;
+	might_sleep();
+	while (ring_pending_to(ring, peer_id, before)) {
+		if (!time_before(get_jiffies_64(), hw_timeout)) {
+			FEE_count(adapter, FEE_CNT_TX_TIMEOUTS, 1);
+			return -ERESTARTSYS;
+		}
+		wait_event_timeout(adapter->outgoing_wqh,
+				   !ring_pending_to(ring, peer_id, before),
+				   msecs_to_jiffies(DELAY_MS_LOOP_MAX));
+	}
+	return 0;
+}
+
+static int ring_reserve_wait(struct FEE_adapter *adapter, struct FEE_ring *ring,
+			     int nonblocking, struct FEE_txmsg *tx)
+{
+	while (!(tx->entry = ring_reserve(ring, &tx->ticket))) {
+		if (nonblocking)
+			return -EAGAIN;
+		if (await_hw_ready(adapter, ring == adapter->mgmt_ring ?
+					    mgmt_has_space : ring_has_space)) {
+			ring_recall(adapter, ring);
+			return -ERESTARTSYS;
+		}
+	}
+	return 0;
+}
+
+// Return 0 with tx->buf ready for up to buflen bytes, else -ERRNO.
+// CID,SID is the order used in the spec.  Ring-capable peers get as many
+// messages in flight as there are ring entries, all others get one.
+// Credit comes first so a full peer doesn't tie up my ring.
+
+int FEE_reserve_outgoing(int CID, int SID, size_t buflen,
+			 struct FEE_adapter *adapter, int nonblocking,
+			 struct FEE_txmsg *tx)
+{
+	struct FEE_mailslot *dest;
+	uint32_t peer_id;
+	int ret;
+
+	peer_id = FEE_peer_id(CID, SID);
 
-	// Might NOT be printable C string.
 	PR_V1("%s(%lu bytes) to %d:%d -> %d\n",
 		__FUNCTION__, buflen, SID, CID, peer_id);
 
@@ -70,81 +790,898 @@ int FEE_create_outgoing(int CID, int SID, char *buf, size_t buflen,
 	if (!buflen)
 		return -ENODATA; // FIXME: is there value to a "silent kick"?
 
-	// Pseudo-"HW ready": wait until my_slot has pushed a previous write
-	// through. In truth it's the previous responder clearing my buflen.
-	// The macro makes many references to its parameters, so...
-	this_delay = 1;
-	while (adapter->my_slot->buflen && time_before(now, hw_timeout)) {
-		if (in_interrupt())
-			mdelay(this_delay); // (25k) leads to compiler error
-		else
-		 	msleep(this_delay);
-		if (this_delay < DELAY_MS_LOOP_MAX)
-			this_delay += 2;
-		now = get_jiffies_64();
+	tx->peer_id = peer_id;
+	tx->buflen = buflen;
+	tx->frag = false;
+	tx->mgmt = false;
+	if ((ret = credit_wait(adapter, nonblocking, tx)))
+		return ret;
+	dest = peer_id < adapter->globals->nEvents ?
+		adapter->peers[peer_id].slot : NULL;
+	if (adapter->tx_ring && buflen <= adapter->tx_ring->max_buflen &&
+	    dest && (dest->caps & FEE_CAP_TXRING)) {
+		if ((ret = ring_reserve_wait(adapter, adapter->tx_ring,
+					     nonblocking, tx)))
+			goto err_credit;
+		tx->buf = tx->entry->buf;
+		return 0;
 	}
-	if ((hw_timeout -= now) > longest) {
-		// pr_warn(FZ "%s() biggest TO goes from %lu to %lu\n",
-			// __FUNCTION__, longest, hw_timeout);
-		longest = hw_timeout;
+	tx->entry = NULL;
+	if ((ret = legacy_reserve(adapter, nonblocking)))
+		goto err_credit;
+	if (adapter->tx_ring && dest && (dest->caps & FEE_CAP_TXRING) &&
+	    (ret = ring_drain_wait(adapter, peer_id, nonblocking))) {
+		clear_bit_unlock(0, &adapter->legacy_busy);
+		if (wq_has_sleeper(&adapter->outgoing_wqh))
+			wake_up(&adapter->outgoing_wqh);
+		goto err_credit;
+	}
+	tx->buf = adapter->my_slot->buf;
+	return 0;
+
+err_credit:
+	if (tx->credit)
+		credit_return(adapter, peer_id);
+	return ret;
+}
+EXPORT_SYMBOL(FEE_reserve_outgoing);
+
+// A management ring entry if both ends have the channel and it fits,
+// else -EOPNOTSUPP and the caller goes the usual way.  Always waits.
+
+static int mgmt_reserve(struct FEE_adapter *adapter, int CID, int SID,
+			size_t buflen, struct FEE_txmsg *tx)
+{
+	uint32_t peer_id = FEE_peer_id(CID, SID);
+	struct FEE_mailslot *dest;
+	int ret;
+
+	if ((SID != GENZ_FEE_SID_DEFAULT && SID != GENZ_FEE_SID_CID_IS_PEER_ID) ||
+	    !adapter->mgmt_ring || !buflen ||
+	    buflen > adapter->mgmt_ring->max_buflen ||
+	    peer_id < 1 || peer_id >= adapter->globals->nEvents ||
+	    !(dest = adapter->peers[peer_id].slot) ||
+	    !(READ_ONCE(dest->caps) & FEE_CAP_MGMT))
+		return -EOPNOTSUPP;
+
+	tx->peer_id = peer_id;
+	tx->buflen = buflen;
+	tx->frag = tx->credit = false;
+	tx->mgmt = true;
+	if ((ret = ring_reserve_wait(adapter, adapter->mgmt_ring, 0, tx)))
+		return ret;
+	tx->buf = tx->entry->buf;
+	return 0;
+}
+
+// Publish a filled reservation and ring the receiver.  Returns buflen.
+// A batching caller may hold the doorbell and FEE_doorbell() once per
+// peer later, but must do so before waiting on any further reservation.
+
+int FEE_commit_outgoing(struct FEE_adapter *adapter, struct FEE_txmsg *tx,
+			int doorbell)
+{
+	struct FEE_ring_entry *entry = tx->entry;
+	struct FEE_mailslot *dest = NULL;
+	u64 sent = 0;
+
+	// Only peers that ring back say when they're done; the time the
+	// server takes is only seen whenever I next look.
+	if (tx->peer_id < adapter->globals->nEvents)
+		dest = adapter->peers[tx->peer_id].slot;
+	if (dest && (dest->caps & FEE_CAP_RINGBACK))
+		sent = ktime_get_ns();
+
+	tx->buf[tx->buflen] = '\0';		// ASCII strings paranoia
+	if (entry) {
+		WRITE_ONCE(*ring_sent(tx->mgmt ? adapter->mgmt_ring :
+					       adapter->tx_ring, tx->ticket), sent);
+		smp_wmb();
+		entry->buflen = tx->buflen | (tx->frag ? FEE_RING_FRAG : 0);
+		entry->peer_id = tx->peer_id;
+		entry->ticket = tx->ticket;
+		wmb();
+		entry->state = FEE_RING_READY;
+		FEE_bar2_publish(adapter);
+	} else {
+		// Keep nodename and buf pointer; update buflen.  buflen is
+		// the handshake out to the world that I'm busy so it goes
+		// last: ring-aware receivers may look before the doorbell.
+		adapter->my_slot->last_responder = tx->peer_id;
+		adapter->legacy_sent_ns = sent;
+		adapter->legacy_peer = tx->peer_id;
+		wmb();
+		adapter->my_slot->buflen = tx->buflen;
+		FEE_bar2_publish(adapter);
+		clear_bit_unlock(0, &adapter->legacy_busy);
+		if (wq_has_sleeper(&adapter->outgoing_wqh))	// Local contention
+			wake_up(&adapter->outgoing_wqh);
 	}
+	trace_fee_send(adapter, tx);
+	if (tx->peer_id < adapter->globals->nEvents)
+		FEE_count_tx(adapter, tx->peer_id, tx->buflen);
+	if (doorbell && tx->mgmt)
+		ring_doorbell_mgmt(adapter, tx->peer_id);
+	else if (doorbell)
+		ring_doorbell_notify(adapter, tx->peer_id);
+	return tx->buflen;
+}
+EXPORT_SYMBOL(FEE_commit_outgoing);
+
+void FEE_doorbell(struct FEE_adapter *adapter, uint32_t peer_id)
+{
+	ring_doorbell_notify(adapter, peer_id);
+}
+EXPORT_SYMBOL(FEE_doorbell);
 
-	// FIXME: add stompcounter tracker, return -EXXXX. To start with, just
-	// emit an error on first occurrence and see what falls out.
-	if (adapter->my_slot->buflen) {
-		pr_err("%s() would stomp previous message to %llu\n",
-			__FUNCTION__, adapter->my_slot->last_responder);
-		return -ERESTARTSYS;
+// Give back a reservation that won't be sent (say, a faulting user copy).
+// A FREE entry with its own ticket looks released to ring_reclaim().
+
+void FEE_abort_outgoing(struct FEE_adapter *adapter, struct FEE_txmsg *tx)
+{
+	if (tx->credit)
+		credit_return(adapter, tx->peer_id);
+	if (tx->entry) {
+		tx->entry->ticket = tx->ticket;
+		wmb();
+		tx->entry->state = FEE_RING_FREE;
+		ring_reclaim(adapter, tx->mgmt ? adapter->mgmt_ring :
+						 adapter->tx_ring);
+	} else
+		clear_bit_unlock(0, &adapter->legacy_busy);
+	if (wq_has_sleeper(&adapter->outgoing_wqh))
+		wake_up(&adapter->outgoing_wqh);
+}
+EXPORT_SYMBOL(FEE_abort_outgoing);
+
+//-------------------------------------------------------------------------
+// Return positive (bytecount) on success, negative on error, never 0.
+// Too big for one message means pieces, if the peer takes them.
+
+int FEE_create_outgoing(int CID, int SID, char *buf, size_t buflen,
+			  struct FEE_adapter *adapter)
+{
+	struct kvec kv = { .iov_base = buf, .iov_len = buflen };
+	struct iov_iter from;
+	struct FEE_txmsg tx;
+	int ret;
+
+	if (buflen >= adapter->max_buflen) {
+		iov_iter_kvec(&from, ITER_SOURCE, &kv, 1, buflen);
+		return FEE_frag_send(adapter, CID, SID, &from, buflen, 0);
 	}
-	// Keep nodename and buf pointer; update buflen and buf contents.
-	// buflen is the handshake out to the world that I'm busy.
-	adapter->my_slot->buflen = buflen;
-	adapter->my_slot->buf[buflen] = '\0';	// ASCII strings paranoia
-	adapter->my_slot->last_responder = peer_id;
-	memcpy(adapter->my_slot->buf, buf, buflen);
 
-	// Choose the correct vector set from all sent to me via the peer.
-	// Trigger the vector corresponding to me with the vector.
-	ringer.peer = peer_id;
-	ringer.vector = adapter->my_id;
-	adapter->regs->Doorbell = ringer.Doorbell;
-	return buflen;
+	// Might NOT be printable C string.
+	if ((ret = FEE_reserve_outgoing(CID, SID, buflen, adapter, 0, &tx)))
+		return ret;
+	memcpy(tx.buf, buf, buflen);
+	return FEE_commit_outgoing(adapter, &tx, 1);
 }
 EXPORT_SYMBOL(FEE_create_outgoing);
 
+// Link management: on the management channel when the peer has one, so
+// it doesn't queue behind data.  The switch doesn't, nor do older drivers.
+
+int FEE_create_mgmt(int CID, int SID, char *buf, size_t buflen,
+		    struct FEE_adapter *adapter)
+{
+	struct FEE_txmsg tx;
+	int ret;
+
+	if ((ret = mgmt_reserve(adapter, CID, SID, buflen, &tx)) == -EOPNOTSUPP)
+		return FEE_create_outgoing(CID, SID, buf, buflen, adapter);
+	if (ret)
+		return ret;
+	memcpy(tx.buf, buf, buflen);
+	return FEE_commit_outgoing(adapter, &tx, 1);
+}
+EXPORT_SYMBOL(FEE_create_mgmt);
+
+//-------------------------------------------------------------------------
+// Find the next message from one sender: its legacy area first, then the
+// oldest READY ring entry addressed to me.  That's the order they were
+// sent in: a sender doesn't publish a legacy message to a ring peer until
+// its older entries to it are claimed (ring_drain_wait()), and it writes
+// entries after that behind a wmb().  A sender advertising any caps
+// names the target of its legacy message (and may ring just to hand space
+// back); the server and older drivers only ever ring the one they mean.
+// Return 0 if nothing, else 1 for an old-style message (one doorbell ==
+// one message) or 2 if more might be waiting.
+
+static void claim_init(struct FEE_rxmsg *msg, uint16_t peer_id)
+{
+	msg->peer_id = peer_id;
+	msg->peer_SID = GENZ_FEE_SID_DEFAULT;	// These are all fixed values
+	msg->peer_CID = peer_id * 100;		// now, but someday...
+	msg->frag = false;
+	msg->mgmt = false;
+}
+
+// The oldest READY entry addressed to me in a ring at base.
+
+static int claim_from_ring(struct FEE_adapter *adapter, char *base,
+			   uint64_t entries, uint64_t entsize,
+			   struct FEE_rxmsg *msg)
+{
+	struct FEE_ring_entry *entry, *oldest;
+	uint64_t i;
+
+rescan:	// Only loops if the sender recalls an entry out from under me.
+	oldest = NULL;
+	for (i = 0; i < entries; i++) {
+		entry = (void *)(base + i * entsize);
+		if (entry->state != FEE_RING_READY ||
+		    entry->peer_id != adapter->my_id)
+			continue;
+		if (!oldest || (int32_t)((uint32_t)entry->ticket -
+					 (uint32_t)oldest->ticket) < 0)
+			oldest = entry;
+	}
+	if (!oldest)
+		return 0;
+	if (cmpxchg(&oldest->state, FEE_RING_READY, FEE_RING_CLAIMED) !=
+	    FEE_RING_READY)
+		goto rescan;
+	rmb();
+	msg->buflen = oldest->buflen & ~FEE_RING_FRAG;
+	msg->frag = !!(oldest->buflen & FEE_RING_FRAG);
+	msg->buf = oldest->buf;
+	msg->cap = entsize - sizeof(struct FEE_ring_entry);
+	msg->release = &oldest->state;
+	return 2;
+}
+
+// What's left at the front of a sender's buffer for its legacy message,
+// after whatever its caps say is carved off the back.
+
+static uint64_t legacy_cap(struct FEE_adapter *adapter,
+			   struct FEE_mailslot *sender)
+{
+	uint64_t caps = READ_ONCE(sender->caps), whole = slot_buflen(adapter),
+		 back = 0;
+
+	if (caps & FEE_CAP_TXRING)
+		back += sender->ring_entries * sender->ring_entsize;
+	if (caps & FEE_CAP_CREDITS)
+		back += adapter->globals->nEvents * sizeof(struct FEE_credit);
+	if (caps & FEE_CAP_MGMT)
+		back += FEE_MGMT_SIZE;
+	return back > whole ? 0 : whole - back;
+}
+
+static int claim_from_peer(struct FEE_adapter *adapter, uint16_t peer_id,
+			   struct FEE_rxmsg *msg)
+{
+	struct FEE_mailslot *sender;
+	uint64_t entries, entsize, whole = slot_buflen(adapter);
+
+	if (!(sender = adapter->peers[peer_id].slot))
+		return 0;
+	claim_init(msg, peer_id);
+
+	if (sender->buflen && (!sender->caps ||
+			       sender->last_responder == adapter->my_id)) {
+		rmb();
+		msg->buflen = sender->buflen;
+		msg->buf = sender->buf;
+		msg->cap = legacy_cap(adapter, sender);
+		msg->release = &sender->buflen;
+		return sender->caps ? 2 : 1;
+	}
+	if (!(sender->caps & FEE_CAP_TXRING))
+		return 0;
+	smp_rmb();	// No legacy message seen means none older than these
+	entries = sender->ring_entries;
+	entsize = sender->ring_entsize;
+	if (!is_power_of_2(entries) ||
+	    entsize <= sizeof(struct FEE_ring_entry) ||
+	    entries * entsize > whole) {
+		pr_err(FEE "peer %u has a bogus send ring\n", peer_id);
+		return 0;
+	}
+	return claim_from_ring(adapter, sender->buf + whole - entries * entsize,
+			       entries, entsize, msg);
+}
+
+static bool claim_mgmt(struct FEE_adapter *adapter, uint16_t peer_id,
+		       struct FEE_rxmsg *msg)
+{
+	struct FEE_mailslot *sender;
+	char *base;
+
+	if (!(sender = adapter->peers[peer_id].slot) ||
+	    !(base = mgmt_ring_base(adapter, sender)))
+		return false;
+	claim_init(msg, peer_id);
+	if (!claim_from_ring(adapter, base, FEE_MGMT_ENTRIES, FEE_MGMT_ENTSIZE,
+			     msg))
+		return false;
+	msg->frag = false;		// Never sent that way
+	msg->mgmt = true;
+	return true;
+}
+
+// Room in the receive queue for management, or for data too?
+
+static bool rxq_room(struct FEE_adapter *adapter, bool data)
+{
+	return !list_empty(&adapter->rxq_free) ||
+	       (!data && !list_empty(&adapter->rxq_mgmt_free));
+}
+
+// Management first, strictly.  Its pending bit is cleared before looking
+// and set again on a find, so a doorbell during the look isn't lost.
+// Then, if data is wanted, round-robin over the senders that rang, so a
+// chatty one doesn't starve the rest.
+
+static bool claim_next(struct FEE_adapter *adapter, struct FEE_rxmsg *msg,
+		       bool data)
+{
+	unsigned long nEvents = adapter->globals->nEvents, peer_id;
+	int ret;
+
+	if (rxq_room(adapter, false)) {
+		for_each_set_bit(peer_id, adapter->mgmt_pending, nEvents) {
+			clear_bit(peer_id, adapter->mgmt_pending);
+			smp_mb__after_atomic();
+			if (claim_mgmt(adapter, peer_id, msg)) {
+				set_bit(peer_id, adapter->mgmt_pending);
+				return true;
+			}
+		}
+	}
+	if (!data || !rxq_room(adapter, true))
+		return false;
+	while (1) {
+		peer_id = find_next_bit(adapter->incoming_pending, nEvents,
+					adapter->incoming_rr);
+		if (peer_id >= nEvents &&
+		    (peer_id = find_first_bit(adapter->incoming_pending,
+					      nEvents)) >= nEvents)
+			return false;
+		adapter->incoming_rr = peer_id + 1;
+		if ((ret = claim_from_peer(adapter, peer_id, msg))) {
+			if (ret == 1)
+				clear_bit(peer_id, adapter->incoming_pending);
+			return true;
+		}
+		clear_bit(peer_id, adapter->incoming_pending);
+	}
+}
+
+//-------------------------------------------------------------------------
+// Receive queue storage.  Every entry can take anything that fits in a
+// slot (a legacy-only peer may use all of its buf[]) plus a NUL.  The
+// descriptor ring and the buffers are one vmalloc_user() area so that
+// FEE_rxq_mmap() can hand the whole thing to user space.  With the
+// management channel the last rxq_nmgmt entries are only for that, so
+// a queue full of unread data can't hold it up.
+
+int FEE_rxq_init(struct FEE_adapter *adapter)
+{
+	unsigned i;
+	size_t ringsize;
+
+	INIT_LIST_HEAD(&adapter->rxq_free);
+	INIT_LIST_HEAD(&adapter->rxq_ready);
+	INIT_LIST_HEAD(&adapter->rxq_mgmt_free);
+	adapter->rxq_nmgmt = mgmt_channel ? FEE_MGMT_ENTRIES : 0;
+	adapter->rxq_nbufs = (rxq_depth > 0 ? rxq_depth : 1) + adapter->rxq_nmgmt;
+	adapter->rxq_ndesc = roundup_pow_of_two(adapter->rxq_nbufs);
+	adapter->rxq_stride = round_up(slot_buflen(adapter) + 1,
+				       L1_CACHE_BYTES);
+	ringsize = PAGE_ALIGN(sizeof(struct gf_bridge_rxring) +
+		adapter->rxq_ndesc * sizeof(struct gf_bridge_rxdesc));
+	adapter->rxq_maplen = ringsize +
+		PAGE_ALIGN(adapter->rxq_nbufs * adapter->rxq_stride);
+
+	if (!(adapter->rxq = kcalloc(adapter->rxq_nbufs,
+				     sizeof(*adapter->rxq), GFP_KERNEL)) ||
+	    !(adapter->rxq_user = kcalloc(BITS_TO_LONGS(adapter->rxq_nbufs),
+					  sizeof(unsigned long), GFP_KERNEL)) ||
+	    !(adapter->rxq_area = vmalloc_user(adapter->rxq_maplen))) {
+		FEE_rxq_destroy(adapter);
+		return -ENOMEM;
+	}
+	adapter->rxq_ring = adapter->rxq_area;
+	adapter->rxq_bufs = adapter->rxq_area + ringsize;
+	for (i = 0; i < adapter->rxq_nbufs; i++) {
+		adapter->rxq[i].buf = adapter->rxq_bufs +
+				      i * adapter->rxq_stride;
+		list_add_tail(&adapter->rxq[i].lister,
+			      FEE_rxq_pool(adapter, &adapter->rxq[i]));
+	}
+	return 0;
+}
+
+void FEE_rxq_destroy(struct FEE_adapter *adapter)
+{
+	vfree(adapter->rxq_area);
+	adapter->rxq_area = NULL;
+	adapter->rxq_ring = NULL;
+	adapter->rxq_bufs = NULL;
+	kfree(adapter->rxq_user);
+	adapter->rxq_user = NULL;
+	kfree(adapter->rxq);
+	adapter->rxq = NULL;
+}
+
+//-------------------------------------------------------------------------
+// Hand a filled entry to whoever consumes: the mapping if there is one,
+// else read().  The caller issues the wakeup.  rxq_prod and rxq_cons are
+// the private copies, rxq_ring just shows them to user space.
+
+static void rxq_post_locked(struct FEE_adapter *adapter, struct FEE_rxmsg *msg)
+{
+	struct gf_bridge_rxdesc *desc;
+	unsigned index = msg - adapter->rxq;
+
+	if (!adapter->rxq_mappers) {
+		list_add_tail(&msg->lister, &adapter->rxq_ready);
+		return;
+	}
+	desc = &adapter->rxq_ring->desc[
+		adapter->rxq_prod & (adapter->rxq_ndesc - 1)];
+	desc->index = index;
+	desc->buflen = msg->buflen;
+	desc->cid = msg->peer_CID;
+	desc->sid = msg->peer_SID;
+	msg->posted = adapter->rxq_prod;
+	set_bit(index, adapter->rxq_user);
+	smp_store_release(&adapter->rxq_ring->prod, ++adapter->rxq_prod);
+}
+
+// A reassembled message doesn't live in its receive buffer so it can't be
+// posted to the mapping; the ring's stride is all user space can see.
+
+static void rxq_drop_reasm(struct FEE_adapter *adapter, struct FEE_rxmsg *msg)
+{
+	pr_err(FEE "receive area is mapped, dropping %llu-byte message from %llu\n",
+	       msg->buflen, msg->peer_id);
+	FEE_count(adapter, FEE_CNT_RX_REASM_DROPS, 1);
+	FEE_release_incoming(adapter, msg);
+}
+
+void FEE_rxq_post(struct FEE_adapter *adapter, struct FEE_rxmsg *msg)
+{
+	unsigned long flags;
+	bool drop;
+
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	if (!(drop = msg->reasm && adapter->rxq_mappers))
+		rxq_post_locked(adapter, msg);
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+	if (drop)
+		rxq_drop_reasm(adapter, msg);
+}
+
+//-------------------------------------------------------------------------
+// One mapping at a time.  Whatever read() hadn't picked up yet moves to
+// the ring.  When the last VMA goes away, buffers user space never handed
+// back are reclaimed; anything posted but unconsumed is dropped with them.
+
+static void rxq_vm_open(struct vm_area_struct *vma)
+{
+	struct FEE_adapter *adapter = vma->vm_private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	adapter->rxq_mappers++;
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+}
+
+static void rxq_vm_close(struct vm_area_struct *vma)
+{
+	struct FEE_adapter *adapter = vma->vm_private_data;
+	unsigned long flags, index;
+	unsigned dropped = 0;
+
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	if (--adapter->rxq_mappers) {
+		spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+		return;
+	}
+	for_each_set_bit(index, adapter->rxq_user, adapter->rxq_nbufs) {
+		if (!test_and_clear_bit(index, adapter->rxq_user))
+			continue;	// Lost a race with FEE_release_index
+		list_add(&adapter->rxq[index].lister,
+			 FEE_rxq_pool(adapter, &adapter->rxq[index]));
+		FEE_credit_free(adapter, &adapter->rxq[index]);
+		dropped++;
+	}
+	adapter->rxq_owner = NULL;
+	adapter->rxq_prod = 0;
+	adapter->rxq_cons = 0;
+	adapter->rxq_ring->prod = 0;
+	adapter->rxq_ring->cons = 0;
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+
+	PR_V1(FEESP "receive area unmapped, %u entries reclaimed\n", dropped);
+	FEE_deliver_incoming(adapter);
+}
+
+static const struct vm_operations_struct rxq_vm_ops = {
+	.open =		rxq_vm_open,
+	.close =	rxq_vm_close,
+};
+
+int FEE_rxq_mmap(struct FEE_adapter *adapter, struct vm_area_struct *vma)
+{
+	struct FEE_rxmsg *msg, *next;
+	unsigned long flags;
+	LIST_HEAD(reasm);
+	int ret;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != adapter->rxq_maplen)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)	// Link and frag work parse in place
+		return -EPERM;
+
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	ret = adapter->rxq_mappers ? -EBUSY : 0;
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+	if (ret)
+		return ret;
+	if ((ret = remap_vmalloc_range(vma, adapter->rxq_area, 0)))
+		return ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_DONTCOPY);
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags |= VM_DONTCOPY;
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	vma->vm_private_data = adapter;
+	vma->vm_ops = &rxq_vm_ops;
+
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	if (adapter->rxq_mappers) {	// Somebody beat me to it
+		spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+		vma->vm_ops = NULL;
+		return -EBUSY;
+	}
+	adapter->rxq_mappers = 1;
+	adapter->rxq_owner = vma->vm_file;
+	list_for_each_entry_safe(msg, next, &adapter->rxq_ready, lister) {
+		list_del(&msg->lister);
+		if (msg->reasm)
+			list_add_tail(&msg->lister, &reasm);
+		else
+			rxq_post_locked(adapter, msg);
+	}
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+	list_for_each_entry_safe(msg, next, &reasm, lister) {
+		list_del(&msg->lister);
+		rxq_drop_reasm(adapter, msg);
+	}
+
+	wake_up_all(&(adapter->incoming_slot_wqh));	// Blocked readers bail
+	return 0;
+}
+EXPORT_SYMBOL(FEE_rxq_mmap);
+
+//-------------------------------------------------------------------------
+// For pollers (the receive timer, busy-polling readers): senders that
+// skipped the doorbell never set their pending bit, so mark all of them.
+// Only driver peers though.  A legacy sender's area might be holding a
+// message for somebody else, and it rings anyway.
+
+void FEE_mark_senders(struct FEE_adapter *adapter)
+{
+	struct FEE_mailslot *sender;
+	unsigned i;
+
+	for (i = 1; i < adapter->globals->nEvents; i++) {
+		if (i == adapter->my_id || !(sender = adapter->peers[i].slot))
+			continue;
+		if (READ_ONCE(sender->caps))
+			set_bit(i, adapter->incoming_pending);
+		if (READ_ONCE(sender->caps) & FEE_CAP_MGMT)
+			set_bit(i, adapter->mgmt_pending);
+	}
+}
+
+//-------------------------------------------------------------------------
+// One doorbell per sender per delivery pass, however many of its messages
+// were pulled.  Only the deliverer touches ringback_pending.
+
+static void ringback(struct FEE_adapter *adapter)
+{
+	unsigned long nEvents = adapter->globals->nEvents, peer_id;
+	struct FEE_mailslot *sender;
+
+	for_each_set_bit(peer_id, adapter->ringback_pending, nEvents) {
+		__clear_bit(peer_id, adapter->ringback_pending);
+		if ((sender = adapter->peers[peer_id].slot) &&
+		    (sender->caps & FEE_CAP_RINGBACK))
+			ring_doorbell(adapter, peer_id);
+	}
+}
+
+//-------------------------------------------------------------------------
+// Called from the doorbell ISR or poll timer after marking senders pending,
+// and from release.  One deliverer at a time; anybody else just leaves a
+// pending bit which the active one picks up before it quits.  The deliverer
+// is the only one taking from rxq_free so a non-empty peek is good enough.
+// Claims at most budget data messages, but all the management there's
+// room for, and returns how many it did, or -EBUSY if somebody else is
+// delivering (and will look again before quitting).  A pending bit left
+// over at the budget is the poll timer's to pick up, so start it.  Budget
+// 0 is management only.
+
+static bool more_pending(struct FEE_adapter *adapter, bool data)
+{
+	unsigned long nEvents = adapter->globals->nEvents;
+
+	return (find_first_bit(adapter->mgmt_pending, nEvents) < nEvents &&
+		rxq_room(adapter, false)) ||
+	       (data && rxq_room(adapter, true) &&
+		find_first_bit(adapter->incoming_pending, nEvents) < nEvents);
+}
+
+int FEE_deliver_budget(struct FEE_adapter *adapter, int budget)
+{
+	struct FEE_rxmsg src, *msg;
+	unsigned long flags;
+	int claimed = 0, queued = 0;
+
+again:
+	if (test_and_set_bit_lock(0, &adapter->incoming_busy)) {
+		if (!claimed)
+			return -EBUSY;
+		goto out;
+	}
+	while (claim_next(adapter, &src, claimed < budget)) {
+		claimed++;
+		// Sized by the sender: don't copy past where it was claimed.
+		if (src.buflen > src.cap || src.buflen >= adapter->rxq_stride) {
+			pr_err(FEE "dropping bogus %llu-byte message from %llu\n",
+				src.buflen, src.peer_id);
+			FEE_count(adapter, FEE_CNT_RX_DROPS, 1);
+			FEE_rxmsg_done(adapter, &src);
+			FEE_credit_free(adapter, &src);
+			__set_bit(src.peer_id, adapter->ringback_pending);
+			continue;
+		}
+		// The sender gets its space back as soon as it's copied.
+		__set_bit(src.peer_id, adapter->ringback_pending);
+
+		// A pong the benchmark is waiting for needs no copy at all.
+		if (!src.frag && FEE_pingbench_pong(adapter, &src)) {
+			FEE_rxmsg_done(adapter, &src);
+			FEE_credit_free(adapter, &src);
+			FEE_count_rx(adapter, src.peer_id, src.buflen);
+			continue;
+		}
+
+		spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+		msg = list_first_entry(
+			src.mgmt && !list_empty(&adapter->rxq_mgmt_free) ?
+				&adapter->rxq_mgmt_free : &adapter->rxq_free,
+			struct FEE_rxmsg, lister);
+		list_del(&msg->lister);
+		spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+		if (src.mgmt)
+			FEE_count(adapter, FEE_CNT_RX_MGMT, 1);
+
+		// Copy it out and let the sender go right now.
+		msg->buflen = src.buflen;
+		msg->peer_id = src.peer_id;
+		msg->peer_SID = src.peer_SID;
+		msg->peer_CID = src.peer_CID;
+		msg->release = NULL;
+		msg->mgmt = src.mgmt;
+		memcpy(msg->buf, src.buf, src.buflen);
+		msg->buf[src.buflen] = '\0';
+		FEE_rxmsg_done(adapter, &src);
+		FEE_count_rx(adapter, src.peer_id, src.buflen);
+		trace_fee_rx(adapter, msg);
+
+		// Pieces and link layer management are dealt with on their
+		// workqueues, otherwise it's a "normal" message for the readers.
+		if (src.frag) {
+			FEE_frag_queue(msg, adapter);
+			continue;
+		}
+		if (FEE_link_queue(msg, adapter))
+			continue;
+
+		FEE_rxq_post(adapter, msg);
+		queued++;
+	}
+	ringback(adapter);
+	clear_bit_unlock(0, &adapter->incoming_busy);
+	smp_mb__after_atomic();
+	if (more_pending(adapter, claimed < budget))
+		goto again;
+	if (claimed >= budget && more_pending(adapter, true))
+		FEE_rx_poll_kick(adapter);
+
+out:
+	if (queued)	// Readers wait exclusively, one each
+		wake_up_nr(&(adapter->incoming_slot_wqh), queued);
+	return claimed;
+}
+
+void FEE_deliver_incoming(struct FEE_adapter *adapter)
+{
+	FEE_deliver_budget(adapter, INT_MAX);
+}
+
 //-------------------------------------------------------------------------
 // Return a pointer to the data structure or ERRPTR, rather than an integer
 // ret, so the caller doesn't need to understand the adapter structure to
-// look it up.  Intermix locking with that in msix_all().
+// look it up.  The message is the caller's until FEE_release_incoming().
 
-struct FEE_mailslot *FEE_await_incoming(struct FEE_adapter *adapter,
-					    int nonblocking)
+static struct FEE_rxmsg *rxq_pop(struct FEE_adapter *adapter)
 {
+	struct FEE_rxmsg *msg;
+	unsigned long flags;
+
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	if ((msg = list_first_entry_or_null(&adapter->rxq_ready,
+					    struct FEE_rxmsg, lister)))
+		list_del(&msg->lister);
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+	return msg;
+}
+
+struct FEE_rxmsg *FEE_await_incoming(struct FEE_adapter *adapter,
+				     int nonblocking)
+{
+	struct FEE_rxmsg *msg;
 	int ret = 0;
 
-	if (adapter->incoming_slot)
-		return adapter->incoming_slot;
-	if (nonblocking)
-		return ERR_PTR(-EAGAIN);
-	PR_V2("%s() waiting...\n", __FUNCTION__);
+	while (!(msg = rxq_pop(adapter))) {
+		if (READ_ONCE(adapter->rxq_mappers))
+			return ERR_PTR(-EBUSY);		// It all goes there
+		if (nonblocking)
+			return ERR_PTR(-EAGAIN);
+		PR_V2("%s() waiting...\n", __FUNCTION__);
 
-	// wait_event_xxx checks the the condition BEFORE waiting but
-	// does modify the run state.  Does that side effect matter?
-	// FIXME: wait_event_interruptible_locked?
-	if ((ret = wait_event_interruptible(adapter->incoming_slot_wqh, 
-					    adapter->incoming_slot)))
-		return ERR_PTR(ret);
-	return adapter->incoming_slot;
+		// wait_event_xxx checks the the condition BEFORE waiting but
+		// does modify the run state.  Another reader may beat me to
+		// it, hence the loop.  Exclusive so one message wakes one
+		// reader; a reader leaving on a signal passes its wakeup on.
+		if ((ret = wait_event_interruptible_exclusive(
+				adapter->incoming_slot_wqh,
+				!list_empty(&adapter->rxq_ready) ||
+				READ_ONCE(adapter->rxq_mappers)))) {
+			if (!list_empty(&adapter->rxq_ready))
+				wake_up(&adapter->incoming_slot_wqh);
+			return ERR_PTR(ret);
+		}
+	}
+	trace_fee_recv(adapter, msg);
+	return msg;
 }
 EXPORT_SYMBOL(FEE_await_incoming);
 
 //-------------------------------------------------------------------------
+// Busy-poll, the SO_BUSY_POLL idea.  Before a blocking reader goes to sleep
+// in FEE_await_incoming() it can pull messages out of the sender slots
+// itself for up to usecs, cutting out the doorbell, softirq and wakeup.
+// Hybrid mode first sleeps on an hrtimer for half the spin that recent
+// polls needed, then spins for the rest, trading a little latency for a
+// lot of CPU.  Returns true if a message is ready; false on timeout,
+// signal, or when the scheduler wants the CPU back.
+
+#define BUSY_POLL_EWMA_SHIFT	3
 
-void FEE_release_incoming(struct FEE_adapter *adapter)
+bool FEE_busy_poll(struct FEE_adapter *adapter, unsigned usecs, int hybrid)
 {
-	spin_lock(&adapter->incoming_slot_lock);
-	adapter->incoming_slot->buflen = 0;	// The slot of the sender.
-	adapter->incoming_slot = NULL;		// The local MSI-X handler.
-	spin_unlock(&adapter->incoming_slot_lock);
+	u64 start, deadline, spun, ewma;
+	int budget = READ_ONCE(rx_budget);
+	bool ready = false;
+
+	if (!usecs || READ_ONCE(adapter->rxq_mappers))
+		return false;
+	if (usecs > FEE_BUSY_POLL_MAX_USECS)
+		usecs = FEE_BUSY_POLL_MAX_USECS;
+	if (budget <= 0)
+		budget = INT_MAX;
+	start = ktime_get_ns();
+	deadline = start + (u64)usecs * NSEC_PER_USEC;
+
+	ewma = READ_ONCE(adapter->busy_poll_ewma_ns);
+	if (hybrid && ewma && list_empty(&adapter->rxq_ready)) {
+		ktime_t nap = ns_to_ktime(min_t(u64, ewma / 2,
+						(u64)usecs * NSEC_PER_USEC / 2));
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout(&nap, HRTIMER_MODE_REL);
+		__set_current_state(TASK_RUNNING);
+	}
+
+	do {
+		if (!list_empty(&adapter->rxq_ready)) {
+			ready = true;
+			break;
+		}
+		FEE_mark_senders(adapter);
+		FEE_deliver_budget(adapter, budget);
+		if (!list_empty(&adapter->rxq_ready)) {
+			ready = true;
+			break;
+		}
+		if (need_resched() || signal_pending(current))
+			break;
+		cpu_relax();
+	} while (ktime_get_ns() < deadline);
+
+	// Only successful polls say how long a message takes to show up.
+	if (ready) {
+		spun = ktime_get_ns() - start;
+		WRITE_ONCE(adapter->busy_poll_ewma_ns,
+			   ewma - (ewma >> BUSY_POLL_EWMA_SHIFT) +
+			   (spun >> BUSY_POLL_EWMA_SHIFT));
+	}
+	return ready;
+}
+EXPORT_SYMBOL(FEE_busy_poll);
+
+// For poll().  With the area mapped, "ready" is whatever user space
+// hasn't consumed from the ring.
+
+bool FEE_incoming_ready(struct FEE_adapter *adapter)
+{
+	if (READ_ONCE(adapter->rxq_mappers))
+		return READ_ONCE(adapter->rxq_cons) !=
+		       READ_ONCE(adapter->rxq_prod);
+	return !list_empty(&adapter->rxq_ready);
+}
+EXPORT_SYMBOL(FEE_incoming_ready);
+
+//-------------------------------------------------------------------------
+// The sender got its space back long ago; this just recycles the queue
+// entry, which may let the deliverer pull more out of pending senders,
+// and gives the sender its credit back.  A reassembled message goes back
+// to its own receive buffer.
+
+void FEE_release_incoming(struct FEE_adapter *adapter, struct FEE_rxmsg *msg)
+{
+	unsigned long flags;
+
+	if (msg->reasm) {
+		kvfree(msg->reasm);
+		atomic64_sub(msg->buflen + 1, &adapter->frag_bytes);
+		msg->reasm = NULL;
+		msg->buf = adapter->rxq_bufs +
+			   (msg - adapter->rxq) * adapter->rxq_stride;
+	}
+
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	list_add(&msg->lister, FEE_rxq_pool(adapter, msg));
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+	FEE_credit_free(adapter, msg);
+	FEE_deliver_incoming(adapter);
 }
 EXPORT_SYMBOL(FEE_release_incoming);
+
+// The mmap() flavor of release: user space only knows the index.  The
+// bit says it was really posted there and not already handed back.  It
+// consumes the buffer's descriptor and any before it; under the lock so
+// an unmap can't reset cons in between.
+
+int FEE_release_index(struct FEE_adapter *adapter, unsigned index)
+{
+	struct FEE_rxmsg *msg;
+	unsigned long flags;
+
+	if (index >= adapter->rxq_nbufs)
+		return -EINVAL;
+	msg = &adapter->rxq[index];
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	if (!test_and_clear_bit(index, adapter->rxq_user)) {
+		spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+		return -EINVAL;
+	}
+	if ((int)(msg->posted + 1 - adapter->rxq_cons) > 0) {
+		adapter->rxq_cons = msg->posted + 1;
+		smp_store_release(&adapter->rxq_ring->cons, adapter->rxq_cons);
+	}
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+	FEE_release_incoming(adapter, msg);
+	return 0;
+}
+EXPORT_SYMBOL(FEE_release_index);
@@ -21,74 +21,244 @@
 // Arch-specific ISR handler for x86_64: configure and handle MSI-X interrupts
 // from IVSHMEM device.
 
+#include <linux/hrtimer.h>
 #include <linux/interrupt.h>	// irq_enable, etc
+#include <linux/irq_work.h>
+#include <linux/version.h>
 
 #include "fee.h"
+#include "fee_trace.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
+#define HRTIMER_MODE_REL_SOFT	HRTIMER_MODE_REL	// hardirq then, fine too
+#endif
+
+#define RX_POLL_MIN_NS		1000		// Breather when over budget
+#define RX_LINGER_MIN_NS	2000		// First step up from zero
+
+//-------------------------------------------------------------------------
+// Polled receive, modelled on NAPI.  While rx_polling is held my slot says
+// FEE_SLOT_NOTIFY_OFF so driver peers stop ringing, and this timer drains
+// up to rx_budget messages per run.  It reschedules itself right away
+// while it keeps hitting the budget, lingers for rx_linger_ns after lighter
+// runs in case the next one's close behind, and otherwise turns doorbells
+// back on.  The linger grows under sustained load and decays when runs come
+// up (nearly) empty, capped at rx_moder_usecs.  The Python server doesn't
+// read caps and still rings every message; that just sets a pending bit.
+
+static void rx_adapt(struct FEE_adapter *adapter, int done, int budget)
+{
+	u64 linger = adapter->rx_linger_ns,
+	    cap = (u64)READ_ONCE(rx_moder_usecs) * NSEC_PER_USEC;
+
+	if (done >= budget / 2)
+		linger = linger ? linger * 2 : RX_LINGER_MIN_NS;
+	else if (done <= 1)
+		linger /= 2;
+	if (linger > cap)
+		linger = cap;
+	if (linger < RX_LINGER_MIN_NS / 4)
+		linger = 0;
+	adapter->rx_linger_ns = linger;
+}
+
+static void notify_off(struct FEE_adapter *adapter)
+{
+	if (!FEE_bar2_atomics(adapter))		// Peers just keep ringing
+		return;
+	set_bit(FEE_SLOT_NOTIFY_OFF_BIT, FEE_slot_caps(adapter->my_slot));
+	smp_mb__after_atomic();
+}
+
+static void notify_on(struct FEE_adapter *adapter)
+{
+	if (!FEE_bar2_atomics(adapter))
+		return;
+	clear_bit(FEE_SLOT_NOTIFY_OFF_BIT, FEE_slot_caps(adapter->my_slot));
+	smp_mb__after_atomic();
+}
+
+static enum hrtimer_restart rx_poll(struct hrtimer *timer)
+{
+	struct FEE_adapter *adapter = container_of(timer, struct FEE_adapter,
+						   rx_poll_timer);
+	int budget = READ_ONCE(rx_budget), done;
+
+	if (budget <= 0)		// Turned off underneath me
+		budget = INT_MAX;
+	FEE_count(adapter, FEE_CNT_RX_POLLS, 1);
+	FEE_mark_senders(adapter);
+	if ((done = FEE_deliver_budget(adapter, budget)) < 0)
+		goto rearm;	// The deliverer looks again before it quits
+	rx_adapt(adapter, done, budget);
+	PR_V3("rx_poll %d/%d, linger %llu ns\n",
+	      done, budget, adapter->rx_linger_ns);
+
+	if (done >= budget) {
+		hrtimer_forward_now(timer, ns_to_ktime(RX_POLL_MIN_NS));
+		return HRTIMER_RESTART;
+	}
+	if (done && adapter->rx_linger_ns) {
+		hrtimer_forward_now(timer, ns_to_ktime(adapter->rx_linger_ns));
+		return HRTIMER_RESTART;
+	}
+
+	// Re-arm doorbells, then look once more for anything sent while
+	// they were off (see ring_doorbell_notify()).  If another deliverer
+	// has it, the pending bits are its problem, not a reason to spin.
+rearm:
+	notify_on(adapter);
+	FEE_mark_senders(adapter);
+	if (FEE_deliver_budget(adapter, budget) > 0) {
+		notify_off(adapter);
+		hrtimer_forward_now(timer, ns_to_ktime(RX_POLL_MIN_NS));
+		return HRTIMER_RESTART;
+	}
+
+	// A doorbell that came in while I held rx_polling only left a
+	// pending bit.  Whatever's left with a full queue waits for release.
+	clear_bit_unlock(0, &adapter->rx_polling);
+	smp_mb__after_atomic();
+	if (!list_empty(&adapter->rxq_free) &&
+	    !test_bit(0, &adapter->incoming_busy) &&
+	    find_first_bit(adapter->incoming_pending,
+			   adapter->globals->nEvents) < adapter->globals->nEvents &&
+	    !test_and_set_bit_lock(0, &adapter->rx_polling)) {
+		notify_off(adapter);
+		hrtimer_forward_now(timer, ns_to_ktime(RX_POLL_MIN_NS));
+		return HRTIMER_RESTART;
+	}
+	return HRTIMER_NORESTART;
+}
+
+// For a deliverer that stopped at its budget with data left: start the
+// timer unless it's running already.  Unlike a doorbell this can come
+// after rx_poll_stop(), hence the lock.
+
+void FEE_rx_poll_kick(struct FEE_adapter *adapter)
+{
+	unsigned long flags;
+
+	if (READ_ONCE(rx_budget) <= 0)
+		return;
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	if (!adapter->rx_poll_stopped &&
+	    !test_and_set_bit_lock(0, &adapter->rx_polling)) {
+		notify_off(adapter);
+		hrtimer_start(&adapter->rx_poll_timer, 0, HRTIMER_MODE_REL_SOFT);
+	}
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+}
+
+static void rx_poll_setup(struct FEE_adapter *adapter)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&adapter->rx_poll_timer, rx_poll,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+#else
+	hrtimer_init(&adapter->rx_poll_timer,
+		     CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	adapter->rx_poll_timer.function = rx_poll;
+#endif
+	adapter->rx_linger_ns = 0;
+	adapter->rx_poll_stopped = false;
+}
+
+// No more doorbells to start it, stop whatever's running.
+
+static void rx_poll_stop(struct FEE_adapter *adapter)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	adapter->rx_poll_stopped = true;
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+	hrtimer_cancel(&adapter->rx_poll_timer);
+	adapter->rx_polling = 0;
+	notify_on(adapter);
+}
 
 //-------------------------------------------------------------------------
-// FIXME: can a spurious interrupt get me here "too fast" so that I'm
-// overrunning the incoming slot during a tight loop client?
+// A doorbell just means "look at my slot".  Messages stay in the sender's
+// slot or ring until claimed, so a second one arriving before read() is
+// merely pending instead of stomped.  Each vector was requested with the
+// FEE_peer of its sender so there's nothing to look up, and no lock here.
 
 static irqreturn_t all_msix(int vector, void *data) {
-	struct FEE_adapter *adapter = data;
-	struct msix_entry *msix_entries = adapter->IRQ_private;
-	int slotnum, stomped = 0;
-	uint16_t incoming_id = 0;	// see pci.h for msix_entry
-	struct FEE_mailslot __iomem *incoming_slot;
-
-	spin_lock(&(adapter->incoming_slot_lock));
-
-	// Match the IRQ vector to entry/vector pair which yields the sender.
-	// Turns out i and msix_entries[i].entry are identical in famez.
-	// FIXME: preload a lookup table if I ever care about speed.
-	for (slotnum = 1; slotnum < adapter->globals->nEvents; slotnum++) {
-		if (vector == msix_entries[slotnum].vector)
-			break;
-	}
-	if (slotnum >= adapter->globals->nEvents) {
-		spin_unlock(&(adapter->incoming_slot_lock));
+	struct FEE_peer *peer = data;
+	struct FEE_adapter *adapter = peer->adapter;
+
+	if (!peer->slot) {	// Slot 0 is globals, nobody rings from there
 		pr_err(FEE "IRQ handler could not match vector %d\n", vector);
 		return IRQ_NONE;
 	}
-	// All returns from here are IRQ_HANDLED
-	
-	incoming_id = msix_entries[slotnum].entry;
-	if (!(incoming_slot = calculate_mailslot(adapter, incoming_id))) {
-		spin_unlock(&(adapter->incoming_slot_lock));
-		pr_err(FEE "Could not match peer %u\n", incoming_id);
-		return IRQ_HANDLED;
+	trace_fee_irq(adapter, vector, peer->peer_id);
+	FEE_count(adapter, FEE_CNT_IRQS, 1);
+
+	// Might be a ringback: the peer handed some of my space back.
+	FEE_tx_harvest(adapter);
+	if (wq_has_sleeper(&adapter->outgoing_wqh))
+		wake_up(&adapter->outgoing_wqh);
+
+	// A sender whose management can't have its own vector rings this one.
+	if (READ_ONCE(peer->slot->caps) & FEE_CAP_MGMT)
+		set_bit(peer->peer_id, adapter->mgmt_pending);
+	set_bit(peer->peer_id, adapter->incoming_pending);
+	if (READ_ONCE(rx_budget) <= 0)		// Old way, all in the ISR
+		FEE_deliver_incoming(adapter);
+	else if (!test_and_set_bit_lock(0, &adapter->rx_polling)) {
+		notify_off(adapter);
+		hrtimer_start(&adapter->rx_poll_timer, 0, HRTIMER_MODE_REL_SOFT);
 	}
+	return IRQ_HANDLED;
+}
+
+// The management vectors, nEvents up.  Management is delivered right
+// here, ahead of (and regardless of) polled data, and never waits for
+// the poll timer.  My own ring is FEE_mgmt_irq_probe() getting through.
 
-	// This may do weird things with the spinlock held.
-	PR_V2("IRQ %d == sender %u -> \"%s\"\n",
-		vector, incoming_id, incoming_slot->buf);
+static irqreturn_t mgmt_msix(int vector, void *data) {
+	struct FEE_peer *peer = data;
+	struct FEE_adapter *adapter = peer->adapter;
 
-	// Link layer management can be fully processed here, otherwise 
-	// deal with a "normal" message.
-	if (FEE_link_request(incoming_slot, adapter) == IRQ_HANDLED)
+	if (!peer->slot) {
+		pr_err(FEE "IRQ handler could not match vector %d\n", vector);
+		return IRQ_NONE;
+	}
+	if (peer->peer_id == adapter->my_id) {
+		if (!test_and_set_bit(FEE_CAP_MGMT_IRQ_BIT,
+				      FEE_slot_caps(adapter->my_slot)))
+			PR_V1(FEESP "management doorbells on vector %d\n",
+			      vector);
 		return IRQ_HANDLED;
+	}
+	trace_fee_irq(adapter, vector, peer->peer_id);
+	FEE_count(adapter, FEE_CNT_IRQS, 1);
+	set_bit(peer->peer_id, adapter->mgmt_pending);
+	FEE_deliver_budget(adapter, 0);
+	return IRQ_HANDLED;
+}
 
-	if (adapter->incoming_slot)	// print outside the spinlock
-		stomped = adapter->incoming_slot->peer_id;
-	adapter->incoming_slot = incoming_slot;
-	spin_unlock(&(adapter->incoming_slot_lock));
+// Vector i is rung by peer (i % nEvents), for data below nEvents and
+// management from there on.
 
-	wake_up(&(adapter->incoming_slot_wqh));
-	if (stomped)
-		pr_warn(FEE "%s() stomped incoming slot for reader %d\n",
-			__FUNCTION__, adapter->my_id);
-	return IRQ_HANDLED;
+static int *vector_irq(struct FEE_adapter *adapter, int i)
+{
+	struct FEE_peer *peer = &adapter->peers[i % adapter->globals->nEvents];
+
+	return i < adapter->globals->nEvents ? &peer->irq : &peer->mgmt_irq;
 }
 
 //-------------------------------------------------------------------------
 // As there are only nClients actual clients (because mailslot 0 is globals
 // and server @ nslots-1) I SHOULDN'T actually activate those two IRQs.
+// Spare vectors beyond nEvents, if there are another nEvents of them,
+// become the management channel's doorbells.
 
 int FEE_ISR_setup(struct pci_dev *pdev)
 {
 	struct FEE_adapter *adapter = pci_get_drvdata(pdev);
-	int ret, i, nvectors = 0, last_irq_index;
-	struct msix_entry *msix_entries;	// pci.h, will be an array
+	int ret, i, nvectors = 0, last_irq_index, nEvents;
 
 	// How many vectors are provided versus neeed?  Slot 0 doesn't need
 	// one but all others do.
@@ -107,79 +277,76 @@ int FEE_ISR_setup(struct pci_dev *pdev)
 			adapter->globals->nEvents, nvectors);
 		return -ENOSPC;
 	}
-	nvectors = adapter->globals->nEvents;		// legibility below
+	nEvents = adapter->globals->nEvents;		// legibility below
+	nvectors = adapter->mgmt_ring && nvectors >= 2 * nEvents ?
+		   2 * nEvents : nEvents;
 
-	ret = -ENOMEM;
-	if (!(msix_entries = kzalloc(
-			nvectors * sizeof(struct msix_entry), GFP_KERNEL))) {
-		pr_err(FEE "Can't allocate MSI-X entries table\n");
-		goto err_kfree_msix_entries;
-	}
-	adapter->IRQ_private = msix_entries;
-
-	// .vector was zeroed by kzalloc
-	for (i = 0; i < nvectors; i++)
-		msix_entries[i].entry = i;
-
-	// There used to be a direct call for "exact match".  Re-create it.
+	// There used to be a direct call for "exact match".  Re-create it,
+	// give or take the management vectors.
 	if ((ret = pci_alloc_irq_vectors(
-		pdev, nvectors, nvectors, PCI_IRQ_MSIX)) < 0) {
+		pdev, nEvents, nvectors, PCI_IRQ_MSIX)) < 0) {
 			pr_err(FEE "Can't allocate MSI-X IRQ vectors\n");
-			goto err_kfree_msix_entries;
+			return ret;
 		}
 	pr_info(FEESP "%2d MSI-X vectors used      (%sabled)\n",
 		ret, pdev->msix_enabled ? "en" : "dis");
-	if (ret < nvectors) {
+	if (ret < nEvents) {
 		pr_err(FEE "%d vectors are not enough\n", ret);
 		ret = -ENOSPC;		// Akin to pci_alloc_irq_vectors
 		goto err_pci_free_irq_vectors;
 	}
+	if (ret < nvectors)
+		nvectors = nEvents;
+	adapter->nvectors = nvectors;
+
+	rx_poll_setup(adapter);
 
-	// Attach each IRQ to the same handler.  pci_irq_vector() walks a
-	// list and returns info on a match.  Success is merely a lookup,
-	// not an allocation, so there's nothing to clean up from this step.
-	// Reuse the table from the old pci_msix_xxx calls.  Note that
-	// requested vectors are still option base 0.
+	// pci_irq_vector() walks a list and returns info on a match.
+	// Success is merely a lookup, not an allocation, so there's nothing
+	// to clean up from this step.  Requested vectors are option base 0
+	// and in famez, vector i is rung by peer i.
 	for (i = 0; i < nvectors; i++) {
 		if ((ret = pci_irq_vector(pdev, i)) < 0) {
 			pr_err("pci_irq_vector(%d) failed: %d\n", i, ret);
 			goto err_pci_free_irq_vectors;
 		}
-		msix_entries[i].vector = ret;
+		*vector_irq(adapter, i) = ret;
 	}
 
-	// Now that they're all batched, assign them.  Each successful request
-	// must be matched by a free_irq() someday.  No, the return value
-	// is not stored anywhere.
+	// Now that they're all batched, assign them, each with the context
+	// of its sender.  Each successful request must be matched by a
+	// free_irq() someday.  No, the return value is not stored anywhere.
 	for (last_irq_index = 0;
 	     last_irq_index < nvectors;
 	     last_irq_index++) {
 		if ((ret = request_irq(
-			msix_entries[last_irq_index].vector,
-			all_msix,
+			*vector_irq(adapter, last_irq_index),
+			last_irq_index < nEvents ? all_msix : mgmt_msix,
 			0,
 			FEE_NAME,
-			adapter))) {
+			&adapter->peers[last_irq_index % nEvents]))) {
 				pr_err(FEE "request_irq(%d) failed: %d\n",
 					last_irq_index, ret);
 				goto err_free_completed_irqs;
 		}
 		PR_V1(FEESP "%d = %d\n",
 		      last_irq_index,
-		      msix_entries[last_irq_index].vector);
+		      *vector_irq(adapter, last_irq_index));
 	}
+	if (nvectors > nEvents && adapter->mgmt_ring)
+		FEE_mgmt_irq_probe(adapter);
 	return 0;
 
 err_free_completed_irqs:
 	for (i = 0; i < last_irq_index; i++)
-		free_irq(msix_entries[i].vector, adapter);
+		free_irq(*vector_irq(adapter, i), &adapter->peers[i % nEvents]);
+	rx_poll_stop(adapter);
 
 err_pci_free_irq_vectors:
+	for (i = 0; i < nvectors; i++)
+		*vector_irq(adapter, i) = 0;
 	pci_free_irq_vectors(pdev);
-
-err_kfree_msix_entries:
-	kfree(msix_entries);
-	adapter->IRQ_private = NULL;	// sentinel for teardown
+	adapter->nvectors = 0;		// sentinel for teardown
 	return ret;
 }
 
@@ -190,15 +357,78 @@ err_kfree_msix_entries:
 void FEE_ISR_teardown(struct pci_dev *pdev)
 {
 	struct FEE_adapter *adapter = pci_get_drvdata(pdev);
-	struct msix_entry *msix_entries = adapter->IRQ_private;
 	int i;
 
-	if (!msix_entries)	// Been there, done that
+	if (!adapter->nvectors)	// Been there, done that
 		return;
 
-	for (i = 0; i < adapter->globals->nClients + 2; i++)
-		free_irq(msix_entries[i].vector, adapter);
+	if (adapter->mgmt_ring)
+		clear_bit(FEE_CAP_MGMT_IRQ_BIT, FEE_slot_caps(adapter->my_slot));
+	for (i = 0; i < adapter->nvectors; i++) {
+		free_irq(*vector_irq(adapter, i),
+			 &adapter->peers[i % adapter->globals->nEvents]);
+		*vector_irq(adapter, i) = 0;
+	}
+
+	rx_poll_stop(adapter);
+
 	pci_free_irq_vectors(pdev);
-	kfree(msix_entries);
-	adapter->IRQ_private = NULL;
+	adapter->nvectors = 0;
+}
+
+//-------------------------------------------------------------------------
+// Loopback adapters (fee_loop.c) have no MSI-X.  A doorbell marks the
+// vector in loop_rung and raises an irq_work, which runs the same handler
+// for each one in hard interrupt context, just as the vector would.
+// Going through irq_work keeps a ringback from recursing into the ringer.
+// All 2 * nEvents vectors are there, management ones included.
+
+static void loop_irq(struct irq_work *work)
+{
+	struct FEE_adapter *adapter = container_of(work, struct FEE_adapter,
+						   loop_irq);
+	unsigned long nEvents = adapter->globals->nEvents, vector;
+
+	for_each_set_bit(vector, adapter->loop_rung, 2 * nEvents) {
+		if (!test_and_clear_bit(vector, adapter->loop_rung))
+			continue;
+		if (vector < nEvents)
+			all_msix(vector, &adapter->peers[vector]);
+		else
+			mgmt_msix(vector, &adapter->peers[vector - nEvents]);
+	}
+}
+
+void FEE_ISR_loop_ring(struct FEE_adapter *adapter, uint16_t vector)
+{
+	if (vector >= 2 * adapter->globals->nEvents)
+		return;
+	set_bit(vector, adapter->loop_rung);
+	irq_work_queue(&adapter->loop_irq);
+}
+
+int FEE_ISR_loop_setup(struct FEE_adapter *adapter)
+{
+	if (!(adapter->loop_rung = kcalloc(
+			BITS_TO_LONGS(2 * adapter->globals->nEvents),
+			sizeof(unsigned long), GFP_KERNEL)))
+		return -ENOMEM;
+	init_irq_work(&adapter->loop_irq, loop_irq);
+	rx_poll_setup(adapter);
+	if (adapter->mgmt_ring)		// No eventfds to run short of
+		set_bit(FEE_CAP_MGMT_IRQ_BIT, FEE_slot_caps(adapter->my_slot));
+	return 0;
+}
+
+// The caller has made sure nobody can ring this adapter any more.
+
+void FEE_ISR_loop_teardown(struct FEE_adapter *adapter)
+{
+	if (!adapter->loop_rung)
+		return;
+	clear_bit(FEE_CAP_MGMT_IRQ_BIT, FEE_slot_caps(adapter->my_slot));
+	irq_work_sync(&adapter->loop_irq);
+	rx_poll_stop(adapter);
+	kfree(adapter->loop_rung);
+	adapter->loop_rung = NULL;
 }
@@ -18,6 +18,7 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <linux/io.h>		// memremap
 #include <linux/utsname.h>
 
 #include "fee.h"
@@ -39,27 +40,40 @@ struct FEE_mailslot __iomem *calculate_mailslot(
 		return NULL;
 	}
 	slot = (void *)(
-		(uint64_t)adapter->globals + slotnum * adapter->globals->slotsize);
+		(uint64_t)adapter->bar2 + slotnum * adapter->globals->slotsize);
 	return slot;
 }
 
 //-------------------------------------------------------------------------
 
+const char * const FEE_bar2_map_names[] = {
+	[FEE_BAR2_UC] = "uc",
+	[FEE_BAR2_WC] = "wc",
+	[FEE_BAR2_WB] = "wb",
+};
+
 static void unmapBARs(struct pci_dev *pdev)
 {
 	struct FEE_adapter *adapter = pci_get_drvdata(pdev);
 
 	if (adapter->regs) pci_iounmap(pdev, adapter->regs);	// else whine
 	adapter->regs = NULL;
-	if (adapter->globals) pci_iounmap(pdev, adapter->globals);
+	if (adapter->bar2 && adapter->bar2_map == FEE_BAR2_WB)
+		memunmap((void __force *)adapter->bar2);
+	else if (adapter->bar2)
+		pci_iounmap(pdev, adapter->bar2);
+	adapter->bar2 = NULL;
 	adapter->globals = NULL;
 	pci_release_regions(pdev);
 }
 
 //-------------------------------------------------------------------------
 // Map the regions and overlay data structures.  Since it's QEMU, ioremap
-// (uncached) for BAR0/1 and ioremap_cached(BAR2) would be fine.  However,
-// the proscribed calls do the start/end/length math so use them.
+// (uncached) for BAR0/1 and a cached BAR2 would be fine: it's host RAM
+// that QEMU and every other guest see coherently.  bar2_map picks; the
+// default stays uncached like real hardware would need.  Whatever can't
+// be had falls back to uncached.  The proscribed calls do the
+// start/end/length math so use them where there are some.
 
 static int mapBARs(struct pci_dev *pdev)
 {
@@ -78,9 +92,21 @@ static int mapBARs(struct pci_dev *pdev)
 	if (!(adapter->regs = pci_iomap(pdev, 0, 0)))
 		goto err_unmap;
 
-	PR_V1(FEESP "Mapping BAR2 globals/mailslots (%llu bytes)\n",
-		pci_resource_len(pdev, 2));
-	if (!(adapter->globals = pci_iomap(pdev, 2, 0)))
+	PR_V1(FEESP "Mapping BAR2 globals/mailslots (%llu bytes, %s)\n",
+		pci_resource_len(pdev, 2), FEE_bar2_map_names[bar2_map]);
+	adapter->bar2_map = bar2_map;
+	if (bar2_map == FEE_BAR2_WB)
+		adapter->bar2 = (void __iomem __force *)memremap(
+			pci_resource_start(pdev, 2),
+			pci_resource_len(pdev, 2), MEMREMAP_WB);
+	else if (bar2_map == FEE_BAR2_WC)
+		adapter->bar2 = pci_iomap_wc(pdev, 2, 0);
+	if (!adapter->bar2 && bar2_map != FEE_BAR2_UC) {
+		pr_err(FEESP "BAR2 %s mapping failed, using uc\n",
+		       FEE_bar2_map_names[bar2_map]);
+		adapter->bar2_map = FEE_BAR2_UC;
+	}
+	if (!adapter->bar2 && !(adapter->bar2 = pci_iomap(pdev, 2, 0)))
 		goto err_unmap;
 	
 	return 0;
@@ -97,100 +123,216 @@ void FEE_adapter_destroy(struct FEE_adapter *adapter)
 	struct pci_dev *pdev;
 
 	if (!adapter) return;	// probably not worth whining
-	if (!(pdev = adapter->pdev)) {
-		pr_err(FEE "destroy_adapter() has NULL pdev\n");
+	if (!adapter->dev) {
+		pr_err(FEE "destroy_adapter() has NULL dev\n");
 		return;
 	}
 
-	unmapBARs(pdev);	// May have be done, doesn't hurt
+	FEE_link_destroy(adapter);	// Before the BARs go away
+	FEE_frag_destroy(adapter);	// Ditto
+	cancel_delayed_work_sync(&adapter->outgoing_watch);
+	FEE_mgmt_destroy(adapter);
+	FEE_credit_destroy(adapter);
+	FEE_ring_destroy(adapter);
+	if ((pdev = adapter->pdev)) {
+		unmapBARs(pdev);	// May have be done, doesn't hurt
+		pci_set_drvdata(pdev, NULL);
+	} else {			// fee_loop.c owns that memory
+		adapter->regs = NULL;
+		adapter->bar2 = NULL;
+		adapter->globals = NULL;
+	}
 
-	dev_set_drvdata(&pdev->dev, NULL);
-	pci_set_drvdata(pdev, NULL);
+	dev_set_drvdata(adapter->dev, NULL);
 	adapter->pdev = NULL;
+	adapter->dev = NULL;
 
-	if (adapter->IRQ_private) kfree(adapter->IRQ_private);
-	adapter->IRQ_private = NULL;
+	kfree(adapter->peers);
+	adapter->peers = NULL;
 	// Probably other memory leakage if this ever executes.
 	if (adapter->outgoing)
 		kfree(adapter->outgoing);
 	adapter->outgoing = NULL;
+	kfree(adapter->incoming_pending);
+	adapter->incoming_pending = NULL;
+	kfree(adapter->mgmt_pending);
+	adapter->mgmt_pending = NULL;
+	kfree(adapter->ringback_pending);
+	adapter->ringback_pending = NULL;
+	free_percpu(adapter->stats);
+	adapter->stats = NULL;
+	free_percpu(adapter->peer_stats);
+	adapter->peer_stats = NULL;
+	free_percpu(adapter->tx_lat);
+	adapter->tx_lat = NULL;
+	FEE_rxq_destroy(adapter);
 
 	genz_core_structure_destroy(adapter->core);
 	kfree(adapter);
 }
 
 //-------------------------------------------------------------------------
-// Set up more globals and mailbox references to realize dynamic padding.
+// The parts that don't care where the registers and mailslots came from.
 
-struct FEE_adapter *FEE_adapter_create(struct pci_dev *pdev)
+static struct FEE_adapter *adapter_alloc(struct device *dev, int slot)
 {
 	struct FEE_adapter *adapter = NULL;
-	int ret;
 
 	if (!(adapter = kzalloc(sizeof(*adapter), GFP_KERNEL))) {
 		pr_err(FEESP "Cannot kzalloc(adapter)\n");
-		return ERR_PTR(-ENOMEM);
+		return NULL;
 	}
 
 	// Lots of backpointers.
-	pci_set_drvdata(pdev, adapter);		// Just pass around pdev.
-	dev_set_drvdata(&pdev->dev, adapter);	// Never hurts to go deep.
-	adapter->pdev = pdev;			// Reverse pointers never hurt.
-	adapter->slot = pdev->devfn >> 3;	// Needed in a few places
+	dev_set_drvdata(dev, adapter);		// Never hurts to go deep.
+	adapter->dev = dev;
+	adapter->slot = slot;			// Needed in a few places
 
 	// Simple fields.
 	init_waitqueue_head(&(adapter->incoming_slot_wqh));
+	init_waitqueue_head(&(adapter->outgoing_wqh));
+	INIT_DELAYED_WORK(&(adapter->outgoing_watch), FEE_outgoing_watch);
 	spin_lock_init(&(adapter->incoming_slot_lock));
+	FEE_pingbench_init(adapter);
+	FEE_bar2bench_init(adapter);
+	return adapter;
+}
 
-	// Real work.
-	if ((ret = mapBARs(pdev))) 
-		goto err_kfree;
+// Set up more globals and mailbox references to realize dynamic padding.
+
+static int adapter_init(struct FEE_adapter *adapter)
+{
+	int i, ret;
 
 	// Now that there's access to globals and registers...Docs for 
 	// pci_iomap() say to use io[read|write]32.  Since this is QEMU,
 	// direct memory references should work.  The offset passed in
 	// globals is handcrafted in Python, make sure it's all kosher.
 	// If these fail, go back and add tests to Python, not here.
+	// The server never changes them, so everything after this reads
+	// a copy instead of going out to BAR2 (uncached, by default).
+	memcpy_fromio(&adapter->globals_copy, adapter->bar2,
+		      sizeof(adapter->globals_copy));
+	adapter->globals = &adapter->globals_copy;
+	ret = -ENOMEM;
+	if (!(adapter->peers = kcalloc(adapter->globals->nEvents,
+				       sizeof(*adapter->peers), GFP_KERNEL)))
+		return ret;
+	if (!(adapter->stats = alloc_percpu(struct FEE_stats)) ||
+	    !(adapter->peer_stats = __alloc_percpu(
+			adapter->globals->nEvents * sizeof(struct FEE_peer_stats),
+			__alignof__(struct FEE_peer_stats))) ||
+	    !(adapter->tx_lat = __alloc_percpu(
+			adapter->globals->nEvents * sizeof(struct FEE_lat_hist),
+			__alignof__(struct FEE_lat_hist))))
+		return ret;
 	ret = -EINVAL;
 	if (offsetof(struct FEE_mailslot, buf) != adapter->globals->buf_offset) {
 		pr_err(FEE "MSG_OFFSET global != C offset in here\n");
-		goto err_kfree;
+		return ret;
 	}
 	if (adapter->globals->slotsize <= adapter->globals->buf_offset) {
 		pr_err(FEE "MSG_OFFSET global is > SLOTSIZE global\n");
-		goto err_kfree;
+		return ret;
 	}
-	adapter->max_buflen = adapter->globals->slotsize -
-			     adapter->globals->buf_offset;
 	adapter->my_id = adapter->regs->IVPosition;
 
+	ret = -ENOMEM;
+	if (!(adapter->incoming_pending = kcalloc(
+			BITS_TO_LONGS(adapter->globals->nEvents),
+			sizeof(unsigned long), GFP_KERNEL)) ||
+	    !(adapter->ringback_pending = kcalloc(
+			BITS_TO_LONGS(adapter->globals->nEvents),
+			sizeof(unsigned long), GFP_KERNEL)) ||
+	    !(adapter->mgmt_pending = kcalloc(
+			BITS_TO_LONGS(adapter->globals->nEvents),
+			sizeof(unsigned long), GFP_KERNEL)))
+		return ret;
+	ret = -EINVAL;
+
 	// All the needed parameters are set to finish this off.
 	if (!(adapter->my_slot = calculate_mailslot(adapter, adapter->my_id)))
-		goto err_kfree;
+		return ret;
+	for (i = 0; i < adapter->globals->nEvents; i++) {
+		adapter->peers[i].adapter = adapter;
+		adapter->peers[i].peer_id = i;
+		if (i)	// Skip the whine about globals
+			adapter->peers[i].slot = calculate_mailslot(adapter, i);
+	}
 	
 	// Zap the slot but recover the peer_id set by server.
 	if (adapter->my_id != adapter->my_slot->peer_id) {
 		pr_err("Server-defined peer ID %llu is wrong\n", adapter->my_slot->peer_id);
-		goto err_kfree;
+		return ret;
 	}
 	memset(adapter->my_slot, 0, adapter->globals->slotsize);
 	adapter->my_slot->peer_id = adapter->my_id;
+	adapter->my_slot->caps = FEE_CAP_RINGBACK | FEE_CAP_BINLINK;
 
 	// Leave room for the NUL in strings.
 	snprintf(adapter->my_slot->nodename,
 		 sizeof(adapter->my_slot->nodename) - 1,
-		 "%s.%02x", utsname()->nodename, adapter->pdev->devfn >> 3);
+		 "%s.%02x", utsname()->nodename, adapter->slot);
 	strncpy(adapter->my_slot->cclass, DEFAULT_CCLASS,
 		sizeof(adapter->my_slot->cclass) - 1);
 
+	// Sets max_buflen, with or without a send ring.
+	if ((ret = FEE_ring_init(adapter)))
+		return ret;
+	if ((ret = FEE_rxq_init(adapter)))
+		return ret;
+	if ((ret = FEE_credit_init(adapter)))	// Takes from max_buflen
+		return ret;
+	if ((ret = FEE_mgmt_init(adapter)))	// Ditto, in front of that
+		return ret;
+	if ((ret = FEE_link_init(adapter)))
+		return ret;
+	if ((ret = FEE_frag_init(adapter)))
+		return ret;
+
 	PR_V1(FEESP "mailslot size=%llu, buf offset=%llu, server=%llu\n",
 		adapter->globals->slotsize,
 		adapter->globals->buf_offset,
 		adapter->globals->server_id);
+	return 0;
+}
+
+struct FEE_adapter *FEE_adapter_create(struct pci_dev *pdev)
+{
+	struct FEE_adapter *adapter;
+	int ret;
+
+	if (!(adapter = adapter_alloc(&pdev->dev, pdev->devfn >> 3)))
+		return ERR_PTR(-ENOMEM);
+	pci_set_drvdata(pdev, adapter);		// Just pass around pdev.
+	adapter->pdev = pdev;			// Reverse pointers never hurt.
 
+	// Real work.
+	if ((ret = mapBARs(pdev)) || (ret = adapter_init(adapter))) {
+		FEE_adapter_destroy(adapter);
+		return ERR_PTR(ret);
+	}
 	return adapter;
+}
+
+// No BARs to map: fee_loop.c hands over its emulated ones.
 
-err_kfree:
-	FEE_adapter_destroy(adapter);
-	return ERR_PTR(ret);
+struct FEE_adapter *FEE_adapter_create_loop(
+	struct device *dev, int slot,
+	struct ivshmem_registers *regs, struct FEE_globals *globals)
+{
+	struct FEE_adapter *adapter;
+	int ret;
+
+	if (!(adapter = adapter_alloc(dev, slot)))
+		return ERR_PTR(-ENOMEM);
+	adapter->loopback = true;
+	adapter->regs = (void __iomem *)regs;
+	adapter->bar2 = (void __iomem *)globals;	// vmalloc, so cached
+	adapter->bar2_map = FEE_BAR2_WB;
+	if ((ret = adapter_init(adapter))) {
+		FEE_adapter_destroy(adapter);
+		return ERR_PTR(ret);
+	}
+	return adapter;
 }
@@ -0,0 +1,208 @@
+/*
+ * (C) Copyright 2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This source code file is part of the EmerGen-Z project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// What the BAR2 mapping (insmod bar2_map) costs, without a peer: the
+// copies every message takes, into and out of this adapter's own legacy
+// area, and reads of a mailslot header field like the receive path does.
+//
+//	echo "<bytes> <count>" > .../genz_fee/<device>/bar2bench
+//	cat .../genz_fee/<device>/bar2bench
+//
+// The legacy area is held like a send while it's written, with buflen
+// still 0, so nobody looks at what's scribbled in it.  A local sender
+// waiting for space ends the run with -EBUSY rather than time out behind
+// it.  Mappings are chosen at insmod time; tools/bar2_compare.sh reloads
+// for each one.
+
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "fee.h"
+
+#define BAR2BENCH_RESCHED	1024		// Header reads between breaks
+
+void FEE_bar2bench_init(struct FEE_adapter *adapter)
+{
+	mutex_init(&adapter->bar2bench.run_lock);
+}
+
+//-------------------------------------------------------------------------
+// Same claim as a legacy send, but don't wait for it.
+
+static int legacy_hold(struct FEE_adapter *adapter)
+{
+	if (test_and_set_bit_lock(0, &adapter->legacy_busy))
+		return -EBUSY;
+	if (READ_ONCE(adapter->my_slot->buflen)) {	// Not handed back yet
+		clear_bit_unlock(0, &adapter->legacy_busy);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+static void legacy_unhold(struct FEE_adapter *adapter)
+{
+	clear_bit_unlock(0, &adapter->legacy_busy);
+	if (wq_has_sleeper(&adapter->outgoing_wqh))
+		wake_up(&adapter->outgoing_wqh);
+}
+
+// Every copy is fenced like one on the message path, so write combining
+// can't just keep gathering the same lines.  Only the writes need the
+// claim; reading my own area (even mid-send) hurts nobody.
+
+static int run(struct FEE_adapter *adapter, uint32_t bytes, uint32_t count)
+{
+	struct FEE_bar2bench *bb = &adapter->bar2bench;
+	char *slotbuf = adapter->my_slot->buf, *kbuf;
+	uint32_t i;
+	u64 start;
+	int ret;
+
+	if (!(kbuf = kmalloc(bytes, GFP_KERNEL)))
+		return -ENOMEM;
+	memset(kbuf, 0x5a, bytes);
+	if ((ret = legacy_hold(adapter)))
+		goto out_free;
+
+	start = ktime_get_ns();
+	for (i = 0; i < count; i++) {
+		memcpy(slotbuf, kbuf, bytes);
+		wmb();
+		if (wq_has_sleeper(&adapter->outgoing_wqh)) {
+			ret = -EBUSY;
+			break;
+		}
+		cond_resched();
+	}
+	bb->result.write_ns = ktime_get_ns() - start;
+	legacy_unhold(adapter);
+	if (ret)
+		goto out_free;
+
+	start = ktime_get_ns();
+	for (i = 0; i < count; i++) {
+		memcpy(kbuf, slotbuf, bytes);
+		mb();
+		cond_resched();
+	}
+	bb->result.read_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	for (i = 0; i < count; i++) {
+		(void)READ_ONCE(adapter->my_slot->buflen);
+		if (!(i % BAR2BENCH_RESCHED))
+			cond_resched();
+	}
+	bb->result.hdr_ns = ktime_get_ns() - start;
+
+out_free:
+	kfree(kbuf);
+	return ret;
+}
+
+//-------------------------------------------------------------------------
+// Decimal MB, bytes per ns * 1000.
+
+static u64 MBps(uint32_t bytes, uint32_t count, u64 ns)
+{
+	return div64_u64((u64)bytes * count * 1000, ns ? : 1);
+}
+
+static int bar2bench_show(struct seq_file *seq, void *unused)
+{
+	struct FEE_adapter *adapter = seq->private;
+	struct FEE_bar2bench *bb = &adapter->bar2bench;
+	int ret;
+
+	if ((ret = mutex_lock_interruptible(&bb->run_lock)))
+		return ret;
+	if (!bb->result.count) {
+		seq_printf(seq, "bar2_map %s\n", FEE_bar2_map_names[adapter->bar2_map]);
+		seq_puts(seq, "usage: echo \"<bytes> <count>\" > bar2bench\n");
+	} else if (bb->result.ret) {
+		seq_printf(seq, "bar2_map %s bytes %u count %u failed %d\n",
+			   FEE_bar2_map_names[bb->result.bar2_map],
+			   bb->result.bytes, bb->result.count, bb->result.ret);
+	} else {
+		seq_printf(seq, "bar2_map %s bytes %u count %u\n",
+			   FEE_bar2_map_names[bb->result.bar2_map],
+			   bb->result.bytes, bb->result.count);
+		seq_printf(seq, "write_MB/s %llu read_MB/s %llu\n",
+			   MBps(bb->result.bytes, bb->result.count,
+				bb->result.write_ns),
+			   MBps(bb->result.bytes, bb->result.count,
+				bb->result.read_ns));
+		seq_printf(seq, "header_read_ns %llu\n",
+			   div_u64(bb->result.hdr_ns, bb->result.count));
+	}
+	mutex_unlock(&bb->run_lock);
+	return 0;
+}
+
+static int bar2bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bar2bench_show, inode->i_private);
+}
+
+static ssize_t bar2bench_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct FEE_adapter *adapter = ((struct seq_file *)file->private_data)->private;
+	struct FEE_bar2bench *bb = &adapter->bar2bench;
+	uint32_t bytes, iterations;
+	char cmd[64];
+	int ret;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+	if (sscanf(cmd, "%u %u", &bytes, &iterations) != 2)
+		return -EINVAL;
+	if (!bytes || bytes > adapter->max_buflen ||
+	    !iterations || iterations > FEE_BAR2BENCH_MAX)
+		return -EINVAL;
+
+	if ((ret = mutex_lock_interruptible(&bb->run_lock)))
+		return ret;
+	memset(&bb->result, 0, sizeof(bb->result));
+	ret = run(adapter, bytes, iterations);
+	bb->result.ret = ret;
+	bb->result.bar2_map = adapter->bar2_map;
+	bb->result.bytes = bytes;
+	bb->result.count = iterations;
+	mutex_unlock(&bb->run_lock);
+	return ret ? ret : count;
+}
+
+const struct file_operations FEE_bar2bench_fops = {
+	.owner =	THIS_MODULE,
+	.open =		bar2bench_open,
+	.read =		seq_read,
+	.write =	bar2bench_write,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
@@ -0,0 +1,185 @@
+/*
+ * (C) Copyright 2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This source code file is part of the EmerGen-Z project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Diagnostics that aren't ABI, under /sys/kernel/debug/genz_fee/<device
+// name>/ (the PCI one, or genz_fee_loop.N).  Like the rest of debugfs,
+// failures here are not fatal and aren't checked.
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+
+#include "fee.h"
+
+struct dentry *FEE_debugfs_root;
+
+//-------------------------------------------------------------------------
+// Send-to-release latency: from commit (doorbell) until the peer hands the
+// space back, see FEE_lat_record().  Bucket b holds [2^(b-1), 2^b) ns.
+// Percentiles are the upper edge of the bucket they fall in, so they
+// overstate by up to 2x.  Writing anything to a file zeroes it.
+
+static const unsigned FEE_lat_pct[] = { 500, 900, 990, 999 };	// Per mille
+
+static u64 bucket_lo(int b)
+{
+	return b ? 1ULL << (b - 1) : 0;
+}
+
+static u64 bucket_hi(int b)
+{
+	return b < FEE_LAT_BUCKETS - 1 ? 1ULL << b : U64_MAX;
+}
+
+// Sum one peer, or all of them when peer_id is negative.
+
+static void lat_sum(struct FEE_adapter *adapter, int peer_id,
+		    struct FEE_lat_hist *hist)
+{
+	struct FEE_lat_hist *pcpu;
+	int cpu, p, b;
+
+	memset(hist, 0, sizeof(*hist));
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(adapter->tx_lat, cpu);
+		for (p = 0; p < adapter->globals->nEvents; p++) {
+			if (peer_id >= 0 && p != peer_id)
+				continue;
+			for (b = 0; b < FEE_LAT_BUCKETS; b++)
+				hist->b[b] += pcpu[p].b[b];
+		}
+	}
+}
+
+static void lat_reset(struct FEE_adapter *adapter, int peer_id)
+{
+	struct FEE_lat_hist *pcpu;
+	int cpu, p;
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(adapter->tx_lat, cpu);
+		for (p = 0; p < adapter->globals->nEvents; p++)
+			if (peer_id < 0 || p == peer_id)
+				memset(&pcpu[p], 0, sizeof(pcpu[p]));
+	}
+}
+
+// The adapter hangs off the file's inode; a peer file's parent directory
+// is named for the peer.
+
+static int lat_peer_id(struct file *file)
+{
+	const char *dir = (const char *)file->f_path.dentry->d_parent->d_name.name;
+	unsigned peer_id;
+
+	if (kstrtouint(dir, 10, &peer_id))
+		return -1;
+	return peer_id;
+}
+
+static int lat_show(struct seq_file *seq, void *unused)
+{
+	struct file *file = seq->file;
+	struct FEE_adapter *adapter = seq->private;
+	int peer_id = lat_peer_id(file), b, i;
+	struct FEE_lat_hist hist;
+	u64 total = 0, running, want;
+
+	lat_sum(adapter, peer_id, &hist);
+	for (b = 0; b < FEE_LAT_BUCKETS; b++)
+		total += hist.b[b];
+	seq_printf(seq, "samples %llu\n", total);
+	if (!total)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(FEE_lat_pct); i++) {
+		want = div_u64(total * FEE_lat_pct[i] + 999, 1000);
+		running = 0;
+		for (b = 0; b < FEE_LAT_BUCKETS - 1; b++)
+			if ((running += hist.b[b]) >= want)
+				break;
+		seq_printf(seq, "p%u.%u <= %llu ns\n",
+			   FEE_lat_pct[i] / 10, FEE_lat_pct[i] % 10, bucket_hi(b));
+	}
+	for (b = 0; b < FEE_LAT_BUCKETS; b++)
+		if (hist.b[b])
+			seq_printf(seq, "%llu %llu %llu\n",
+				   bucket_lo(b), bucket_hi(b), hist.b[b]);
+	return 0;
+}
+
+static int lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lat_show, inode->i_private);
+}
+
+static ssize_t lat_write(struct file *file, const char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+
+	lat_reset(seq->private, lat_peer_id(file));
+	return count;
+}
+
+static const struct file_operations lat_fops = {
+	.owner =	THIS_MODULE,
+	.open =		lat_open,
+	.read =		seq_read,
+	.write =	lat_write,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+//-------------------------------------------------------------------------
+// Same peers as sysfs fee_peers/.  Those that don't ring back (the
+// server, older drivers) stay empty.
+
+void FEE_debugfs_init(struct FEE_adapter *adapter)
+{
+	struct dentry *peers, *dir;
+	char name[8];
+	int i;
+
+	adapter->debugfs = debugfs_create_dir(dev_name(adapter->dev),
+					      FEE_debugfs_root);
+	debugfs_create_file("tx_release_hist", 0644, adapter->debugfs,
+			    adapter, &lat_fops);
+	debugfs_create_file("pingbench", 0600, adapter->debugfs,
+			    adapter, &FEE_pingbench_fops);
+	debugfs_create_file("bar2bench", 0600, adapter->debugfs,
+			    adapter, &FEE_bar2bench_fops);
+	peers = debugfs_create_dir("peers", adapter->debugfs);
+	for (i = 0; i < adapter->globals->nEvents; i++) {
+		if (!adapter->peers[i].slot)
+			continue;
+		snprintf(name, sizeof(name), "%d", i);
+		dir = debugfs_create_dir(name, peers);
+		debugfs_create_file("tx_release_hist", 0644, dir,
+				    adapter, &lat_fops);
+	}
+}
+
+void FEE_debugfs_destroy(struct FEE_adapter *adapter)
+{
+	debugfs_remove_recursive(adapter->debugfs);
+	adapter->debugfs = NULL;
+}
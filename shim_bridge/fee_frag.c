@@ -0,0 +1,312 @@
+/*
+ * (C) Copyright 2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This source code file is part of the EmerGen-Z project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Messages bigger than a mailslot.  The sender cuts them into send ring
+// entries flagged FEE_RING_FRAG, each starting with a struct FEE_frag_hdr,
+// and keeps as many in flight as the ring holds.  The receiver copies the
+// pieces off the receive path like anything else and puts them back
+// together here, in process context, where a big buffer can be had.
+// Only peers advertising FEE_CAP_FRAG (and FEE_CAP_TXRING) get pieces;
+// for the rest, too big is still -E2BIG.
+
+#include <linux/jiffies.h>
+#include <linux/mm.h>		// kvmalloc
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+
+#include "fee.h"
+
+#define FRAG_TIMEOUT		(5 * HZ)	// Sender quit halfway
+#define FRAG_MAX_PER_PEER	4		// Being put together at once
+
+struct reasm {
+	struct list_head lister;		// FEE_peer.reasm, oldest first
+	uint64_t msg_id, total, got;
+	unsigned long started;			// jiffies
+	char *buf;				// total + 1 for a NUL
+};
+
+//-------------------------------------------------------------------------
+// Return buflen or -ERRNO.  Only the first piece honors nonblocking; once
+// one is out the rest wait for space, ringing the receiver first so it
+// can make some.  A piece that times out leaves the receiver to drop the
+// rest after FRAG_TIMEOUT.
+
+int FEE_frag_send(struct FEE_adapter *adapter, int CID, int SID,
+		  struct iov_iter *from, size_t buflen, int nonblocking)
+{
+	uint32_t peer_id = FEE_peer_id(CID, SID);
+	struct FEE_mailslot *dest = NULL;
+	struct FEE_frag_hdr hdr;
+	struct FEE_txmsg tx;
+	size_t chunk, most;
+	int ret = 0;
+
+	if (peer_id < adapter->globals->nEvents)
+		dest = adapter->peers[peer_id].slot;
+	if (!adapter->tx_ring || !dest ||
+	    (READ_ONCE(dest->caps) & (FEE_CAP_TXRING | FEE_CAP_FRAG)) !=
+	    (FEE_CAP_TXRING | FEE_CAP_FRAG) ||
+	    buflen > (size_t)READ_ONCE(frag_max_mb) << 20)
+		return -E2BIG;
+	most = adapter->tx_ring->max_buflen - sizeof(hdr);
+
+	hdr.msg_id = (uint32_t)atomic_inc_return(&adapter->frag_msg_id);
+	hdr.total = buflen;
+	for (hdr.offset = 0; hdr.offset < buflen; hdr.offset += chunk) {
+		chunk = min_t(size_t, buflen - hdr.offset, most);
+		ret = FEE_reserve_outgoing(CID, SID, sizeof(hdr) + chunk,
+					   adapter, 1, &tx);
+		if (ret == -EAGAIN && (hdr.offset || !nonblocking)) {
+			FEE_doorbell(adapter, peer_id);
+			ret = FEE_reserve_outgoing(CID, SID, sizeof(hdr) + chunk,
+						   adapter, 0, &tx);
+		}
+		if (ret)
+			break;
+		if (!tx.entry) {		// Can't happen, see above
+			FEE_abort_outgoing(adapter, &tx);
+			ret = -EIO;
+			break;
+		}
+		memcpy(tx.buf, &hdr, sizeof(hdr));
+		if (copy_from_iter(tx.buf + sizeof(hdr), chunk, from) != chunk) {
+			FEE_abort_outgoing(adapter, &tx);
+			ret = -EFAULT;
+			break;
+		}
+		// Ring for the first so the receiver gets going, then only
+		// when the ring fills up and at the end.
+		tx.frag = true;
+		FEE_commit_outgoing(adapter, &tx, !hdr.offset);
+	}
+	if (hdr.offset)
+		FEE_doorbell(adapter, peer_id);
+	return ret ? ret : buflen;
+}
+EXPORT_SYMBOL(FEE_frag_send);
+
+//-------------------------------------------------------------------------
+// Everything from here down runs on the adapter's ordered frag_wq, the
+// only user of the FEE_peer reassembly lists.  Buffers count against
+// frag_bytes until freed here or, once handed to the readers, on release.
+
+static void reasm_free(struct FEE_adapter *adapter, struct FEE_peer *peer,
+		       struct reasm *r)
+{
+	list_del(&r->lister);
+	peer->nreasm--;
+	if (r->buf) {
+		kvfree(r->buf);
+		atomic64_sub(r->total + 1, &adapter->frag_bytes);
+	}
+	kfree(r);
+}
+
+static void reasm_drop(struct FEE_adapter *adapter, struct FEE_peer *peer,
+		       struct reasm *r, const char *why)
+{
+	pr_err(FEE "peer %u message %llu %s at %llu of %llu bytes\n",
+	       peer->peer_id, r->msg_id, why, r->got, r->total);
+	FEE_count(adapter, FEE_CNT_RX_REASM_DROPS, 1);
+	reasm_free(adapter, peer, r);
+}
+
+// Find msg_id's context, throwing out stale ones on the way.
+
+static struct reasm *reasm_find(struct FEE_adapter *adapter,
+				struct FEE_peer *peer, uint64_t msg_id)
+{
+	struct reasm *r, *next, *found = NULL;
+
+	list_for_each_entry_safe(r, next, &peer->reasm, lister) {
+		if (r->msg_id == msg_id)
+			found = r;
+		else if (time_after(jiffies, r->started + FRAG_TIMEOUT))
+			reasm_drop(adapter, peer, r, "timed out");
+	}
+	return found;
+}
+
+static struct reasm *reasm_start(struct FEE_adapter *adapter,
+				 struct FEE_peer *peer,
+				 struct FEE_frag_hdr *hdr)
+{
+	struct reasm *r;
+
+	if (hdr->offset || !hdr->total ||
+	    hdr->total > (uint64_t)READ_ONCE(frag_max_mb) << 20)
+		return NULL;
+	if (peer->nreasm >= FRAG_MAX_PER_PEER)
+		reasm_drop(adapter, peer, list_first_entry(
+			&peer->reasm, struct reasm, lister), "pushed out");
+
+	// Every peer shares the one budget, or a handful of them could
+	// have gigabytes half put together.
+	if (atomic64_add_return(hdr->total + 1, &adapter->frag_bytes) >
+	    (s64)READ_ONCE(frag_budget_mb) << 20) {
+		pr_err(FEE "peer %u message %llu over the reassembly budget\n",
+		       peer->peer_id, hdr->msg_id);
+		goto err_budget;
+	}
+	if (!(r = kzalloc(sizeof(*r), GFP_KERNEL)))
+		goto err_budget;
+	if (!(r->buf = kvmalloc(hdr->total + 1, GFP_KERNEL))) {
+		kfree(r);
+		goto err_budget;
+	}
+	r->msg_id = hdr->msg_id;
+	r->total = hdr->total;
+	r->started = jiffies;
+	list_add_tail(&r->lister, &peer->reasm);
+	peer->nreasm++;
+	return r;
+
+err_budget:
+	atomic64_sub(hdr->total + 1, &adapter->frag_bytes);
+	return NULL;
+}
+
+// msg is a receive queue copy of one piece.  The last piece's entry
+// carries the whole message to the readers; the others go straight back.
+
+static void frag_one(struct FEE_adapter *adapter, struct FEE_rxmsg *msg)
+{
+	struct FEE_peer *peer = &adapter->peers[msg->peer_id];
+	struct FEE_frag_hdr hdr;
+	struct reasm *r;
+	uint64_t len;
+
+	if (msg->buflen <= sizeof(hdr))
+		goto drop;
+	memcpy(&hdr, msg->buf, sizeof(hdr));
+	len = msg->buflen - sizeof(hdr);
+
+	if (!(r = reasm_find(adapter, peer, hdr.msg_id)) &&
+	    !(r = reasm_start(adapter, peer, &hdr)))
+		goto drop;
+	if (hdr.offset != r->got || hdr.total != r->total ||
+	    len > r->total - r->got) {
+		reasm_drop(adapter, peer, r, "out of order");	// Counts it
+		goto release;
+	}
+	memcpy(r->buf + r->got, msg->buf + sizeof(hdr), len);
+	if ((r->got += len) < r->total) {
+		FEE_release_incoming(adapter, msg);
+		return;
+	}
+
+	r->buf[r->total] = '\0';	// ASCII strings paranoia
+	msg->reasm = msg->buf = r->buf;
+	msg->buflen = r->total;
+	r->buf = NULL;
+	reasm_free(adapter, peer, r);
+	FEE_count(adapter, FEE_CNT_RX_REASM, 1);
+	FEE_rxq_post(adapter, msg);
+	wake_up(&(adapter->incoming_slot_wqh));
+	return;
+
+drop:
+	FEE_count(adapter, FEE_CNT_RX_REASM_DROPS, 1);
+release:
+	FEE_release_incoming(adapter, msg);
+}
+
+static void frag_worker(struct work_struct *work)
+{
+	struct FEE_adapter *adapter = container_of(
+		work, struct FEE_adapter, frag_work);
+	struct FEE_rxmsg *msg;
+	unsigned long flags;
+
+	while (1) {
+		spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+		if ((msg = list_first_entry_or_null(&adapter->rxq_frag,
+						    struct FEE_rxmsg, lister)))
+			list_del(&msg->lister);
+		spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+		if (!msg)
+			return;
+		frag_one(adapter, msg);
+	}
+}
+
+//-------------------------------------------------------------------------
+// Called by the deliverer in interrupt context with a receive queue copy
+// of a piece.  Without the workqueue (going away) it's just dropped.
+
+void FEE_frag_queue(struct FEE_rxmsg *msg, struct FEE_adapter *adapter)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	if (adapter->frag_wq)
+		list_add_tail(&msg->lister, &adapter->rxq_frag);
+	else
+		list_add(&msg->lister, FEE_rxq_pool(adapter, msg));
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+	if (adapter->frag_wq) {
+		queue_work(adapter->frag_wq, &adapter->frag_work);
+		return;
+	}
+	FEE_count(adapter, FEE_CNT_RX_REASM_DROPS, 1);
+	FEE_credit_free(adapter, msg);
+}
+
+//-------------------------------------------------------------------------
+// Ordered: pieces of a message are put together in the order they came.
+
+int FEE_frag_init(struct FEE_adapter *adapter)
+{
+	int i;
+
+	INIT_LIST_HEAD(&adapter->rxq_frag);
+	INIT_WORK(&adapter->frag_work, frag_worker);
+	for (i = 0; i < adapter->globals->nEvents; i++)
+		INIT_LIST_HEAD(&adapter->peers[i].reasm);
+	if (!(adapter->frag_wq = alloc_ordered_workqueue(
+			"%s.%02x.frag", 0, FEE_NAME, adapter->slot))) {
+		pr_err(FEESP "Cannot allocate fragment workqueue\n");
+		return -ENOMEM;
+	}
+	adapter->my_slot->caps |= FEE_CAP_FRAG;
+	return 0;
+}
+
+// Interrupts must be gone by now so nothing new gets queued.  Whatever
+// was half done never will be.
+
+void FEE_frag_destroy(struct FEE_adapter *adapter)
+{
+	struct reasm *r, *next;
+	int i;
+
+	if (!adapter->frag_wq)
+		return;
+	if (adapter->globals && adapter->my_slot)
+		adapter->my_slot->caps &= ~FEE_CAP_FRAG;
+	destroy_workqueue(adapter->frag_wq);	// Drains it first
+	adapter->frag_wq = NULL;
+	for (i = 0; i < adapter->globals->nEvents; i++)
+		list_for_each_entry_safe(r, next, &adapter->peers[i].reasm,
+					 lister)
+			reasm_free(adapter, &adapter->peers[i], r);
+}
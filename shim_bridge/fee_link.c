@@ -21,10 +21,14 @@
 // Link-level messages, mostly from the switch (IVSHMSG server).
 // It may hijack and finish off the message.
 
+#include <linux/workqueue.h>
+
 #include "fee.h"
+#include "fee_trace.h"
 
 // See ivshmsg_requests.py:_Link_CTL(), etc for required formats.
-// I'm skipping the tracker EZT for now.
+// I'm skipping the tracker EZT for now.  Drivers advertising
+// FEE_CAP_BINLINK use the genz_link_*_format equivalents instead.
 
 #define LINK_CTL_PEER_ATTRIBUTE \
 	"Link CTL Peer-Attribute"
@@ -38,65 +42,252 @@
 #define STANDALONE_ACKNOWLEDGMENT \
 	"Standalone Acknowledgment Tag=%d,Reason=OK"
 
+#define CTL_WRITE_PREFIX	"CTL-Write "
+
+// One per request type.  match, if any, finishes the classification in
+// the deliverer, so whatever isn't mine goes to the readers right there,
+// in order with the rest from that sender.  The handler runs in
+// link_worker() and only ever gets requests it takes.
+
+struct FEE_link_op {
+	const char *name;		// For the tracepoint
+	const char *prefix;		// ASCII only
+	size_t len;			// Exact request length, 0 == any
+	bool (*match)(const struct FEE_rxmsg *);
+	void (*handler)(struct FEE_adapter *, struct FEE_rxmsg *);
+};
+
 //-------------------------------------------------------------------------
-// This is called in interrupt context with the incoming_slot->lock held.
+// Process context on the adapter's ordered workqueue, so replies may sleep
+// waiting for my own outgoing space.  msg is a receive queue copy, the
+// sender got its space back before this was queued.  Replies go back in
+// the form the request came in, on the management channel if it has one.
+
+static void link_reply(struct FEE_adapter *adapter, struct FEE_rxmsg *msg,
+		       void *buf, size_t buflen)
+{
+	FEE_create_mgmt(
+		msg->peer_id,
+		GENZ_FEE_SID_CID_IS_PEER_ID,
+		buf, buflen,
+		adapter);
+}
+
+static void set_cid_sid(struct FEE_adapter *adapter,
+			int PFMCID, int PFMSID, int CID, int SID)
+{
+	adapter->core->PFMCID = PFMCID;
+	adapter->core->PFMSID = PFMSID;
+	adapter->core->CID0 = CID;
+	adapter->core->SID0 = SID;
+	adapter->core->PMCID = -1;
+}
+
+// Simple proof-of-life.
+
+static void ascii_ping(struct FEE_adapter *adapter, struct FEE_rxmsg *msg)
+{
+	link_reply(adapter, msg, "pong", 4);
+}
+
+static void bin_ping(struct FEE_adapter *adapter, struct FEE_rxmsg *msg)
+{
+	struct genz_link_header_format pong;
+
+	FEE_link_header(&pong, GENZ_LINK_PONG);
+	link_reply(adapter, msg, &pong, sizeof(pong));
+}
 
-irqreturn_t FEE_link_request(struct FEE_mailslot __iomem *incoming_slot,
-			       struct FEE_adapter *adapter)
+static void ascii_peer_attribute(struct FEE_adapter *adapter,
+				 struct FEE_rxmsg *msg)
+{
+	char outbuf[128];
+
+	sprintf(outbuf, LINK_CTL_ACK,
+		adapter->core->Base_C_Class_str,
+		adapter->core->CID0,
+		adapter->core->SID0);
+	link_reply(adapter, msg, outbuf, strlen(outbuf));
+}
+
+static void bin_peer_attribute(struct FEE_adapter *adapter,
+			       struct FEE_rxmsg *msg)
+{
+	struct genz_link_peer_attribute_ack_format ack = { };
+
+	FEE_link_header(&ack, GENZ_LINK_PEER_ATTRIBUTE_ACK);
+	strncpy(ack.C_Class, adapter->core->Base_C_Class_str,
+		sizeof(ack.C_Class) - 1);
+	ack.CID0 = adapter->core->CID0;
+	ack.SID0 = adapter->core->SID0;
+	link_reply(adapter, msg, &ack, sizeof(ack));
+}
+
+// Any other CTL-Write isn't mine.  The handler scans again rather than
+// carry the fields from the deliverer; it's once per assignment.
+
+static bool ascii_ctl_write_match(const struct FEE_rxmsg *msg)
+{
+	uint32_t PFMSID, PFMCID, SID, CID, tag;
+
+	return sscanf(msg->buf, CTL_WRITE_0_CID_SID,
+		      &PFMCID, &PFMSID, &CID, &SID, &tag) == 5;
+}
+
+static void ascii_ctl_write(struct FEE_adapter *adapter,
+			    struct FEE_rxmsg *msg)
 {
 	uint32_t PFMSID, PFMCID, SID, CID, tag;
 	char outbuf[128];
 
-	// These are all fixed values now, but someday...
-	incoming_slot->peer_SID = GENZ_FEE_SID_DEFAULT;
-	incoming_slot->peer_CID = incoming_slot->peer_id * 100;
-
-	// Simple proof-of-life, must be an exact match.
-	if (incoming_slot->buflen == 4 &&
-	    STREQ_N(incoming_slot->buf, "ping", 4)) {
-		incoming_slot->buflen = 0;	// buf received
-		spin_unlock(&(adapter->incoming_slot_lock));
-		FEE_create_outgoing(
-			incoming_slot->peer_id,
-			GENZ_FEE_SID_CID_IS_PEER_ID,
-			"pong", 4,
-			adapter);
-		return IRQ_HANDLED;
+	if (sscanf(msg->buf, CTL_WRITE_0_CID_SID,
+		   &PFMCID, &PFMSID, &CID, &SID, &tag) != 5)
+		return;			// Can't happen, see above
+	set_cid_sid(adapter, PFMCID, PFMSID, CID, SID);
+	sprintf(outbuf, STANDALONE_ACKNOWLEDGMENT, tag);
+	link_reply(adapter, msg, outbuf, strlen(outbuf));
+}
+
+static bool bin_ctl_write_match(const struct FEE_rxmsg *msg)
+{
+	const struct genz_link_ctl_write_cid_sid_format *req = (void *)msg->buf;
+
+	return !req->Space;
+}
+
+static void bin_ctl_write(struct FEE_adapter *adapter, struct FEE_rxmsg *msg)
+{
+	struct genz_link_ctl_write_cid_sid_format *req = (void *)msg->buf;
+	struct genz_link_standalone_ack_format ack;
+
+	set_cid_sid(adapter, req->PFMCID, req->PFMSID, req->CID, req->SID);
+	FEE_link_header(&ack, GENZ_LINK_STANDALONE_ACK);
+	ack.Tag = req->Tag;
+	ack.Reason = GENZ_LINK_REASON_OK;
+	link_reply(adapter, msg, &ack, sizeof(ack));
+}
+
+// Indexed by opcode.  Replies (PONG, the ACKs) have no handler and go to
+// the readers like they always did.
+
+static const struct FEE_link_op link_bin_ops[GENZ_LINK_NOPCODES] = {
+	[GENZ_LINK_PING] = {
+		"ping", NULL, sizeof(struct genz_link_header_format),
+		NULL, bin_ping },
+	[GENZ_LINK_PEER_ATTRIBUTE] = {
+		"Peer-Attribute", NULL, sizeof(struct genz_link_header_format),
+		NULL, bin_peer_attribute },
+	[GENZ_LINK_CTL_WRITE_CID_SID] = {
+		"CTL-Write", NULL,
+		sizeof(struct genz_link_ctl_write_cid_sid_format),
+		bin_ctl_write_match, bin_ctl_write },
+};
+
+static const struct FEE_link_op link_ascii_ops[] = {
+	{ "ping", "ping", 4, NULL, ascii_ping },
+	{ "Peer-Attribute", LINK_CTL_PEER_ATTRIBUTE, 0,
+	  NULL, ascii_peer_attribute },
+	{ "CTL-Write", CTL_WRITE_PREFIX, 0,
+	  ascii_ctl_write_match, ascii_ctl_write },
+};
+
+//-------------------------------------------------------------------------
+// Called by the deliverer in interrupt context on every received message.
+// A binary request is one compare and a table lookup.  The ASCII forms are
+// only looked for from peers that can't do binary (the Python switch,
+// older drivers), so data between drivers never sees a strncmp.  Anything
+// claimed is processed later by link_worker(); anything not claimed goes
+// to the readers now.
+
+static const struct FEE_link_op *link_classify(struct FEE_adapter *adapter,
+					       struct FEE_rxmsg *msg)
+{
+	const struct genz_link_header_format *hdr = (void *)msg->buf;
+	struct FEE_mailslot *sender = adapter->peers[msg->peer_id].slot;
+	const struct FEE_link_op *op;
+	int i;
+
+	if (msg->buflen >= sizeof(*hdr) && hdr->magic == GENZ_LINK_MAGIC) {
+		if (hdr->version != GENZ_LINK_VERSION ||
+		    hdr->opcode >= GENZ_LINK_NOPCODES)
+			return NULL;
+		op = &link_bin_ops[hdr->opcode];
+		if (!op->handler || msg->buflen != op->len)
+			return NULL;
+		return !op->match || op->match(msg) ? op : NULL;
+	}
+
+	if (sender && (READ_ONCE(sender->caps) & FEE_CAP_BINLINK))
+		return NULL;
+	for (i = 0; i < ARRAY_SIZE(link_ascii_ops); i++) {
+		op = &link_ascii_ops[i];
+		if (op->len && msg->buflen != op->len)
+			continue;
+		if (STREQ_N(msg->buf, op->prefix, strlen(op->prefix)))
+			return !op->match || op->match(msg) ? op : NULL;
 	}
+	return NULL;
+}
+
+bool FEE_link_queue(struct FEE_rxmsg *msg, struct FEE_adapter *adapter)
+{
+	unsigned long flags;
+
+	if (!adapter->link_wq || !(msg->link_op = link_classify(adapter, msg)))
+		return false;
+	spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+	list_add_tail(&msg->lister, &adapter->rxq_link);
+	spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+	queue_work(adapter->link_wq, &adapter->link_work);
+	return true;
+}
+
+//-------------------------------------------------------------------------
+
+static void link_worker(struct work_struct *work)
+{
+	struct FEE_adapter *adapter = container_of(
+		work, struct FEE_adapter, link_work);
+	struct FEE_rxmsg *msg;
+	unsigned long flags;
 
-	if (STREQ_N(incoming_slot->buf, LINK_CTL_PEER_ATTRIBUTE,
-		strlen(LINK_CTL_PEER_ATTRIBUTE))) {
-		incoming_slot->buflen = 0;	// buf received
-		spin_unlock(&(adapter->incoming_slot_lock));
-		sprintf(outbuf, LINK_CTL_ACK,
-			adapter->core->Base_C_Class_str,
-			adapter->core->CID0,
-			adapter->core->SID0);
-		FEE_create_outgoing(
-			incoming_slot->peer_id,
-			GENZ_FEE_SID_CID_IS_PEER_ID,
-			outbuf, strlen(outbuf),
-			adapter);
-		return IRQ_HANDLED;
+	while (1) {
+		spin_lock_irqsave(&adapter->incoming_slot_lock, flags);
+		if ((msg = list_first_entry_or_null(&adapter->rxq_link,
+						    struct FEE_rxmsg, lister)))
+			list_del(&msg->lister);
+		spin_unlock_irqrestore(&adapter->incoming_slot_lock, flags);
+		if (!msg)
+			return;
+
+		msg->link_op->handler(adapter, msg);
+		trace_fee_link(adapter, msg, msg->link_op->name);
+		FEE_count(adapter, FEE_CNT_LINK_MSGS, 1);
+		FEE_release_incoming(adapter, msg);
 	}
+}
+
+//-------------------------------------------------------------------------
+// Ordered: replies go out in the order the requests came in.
 
-	if (sscanf(incoming_slot->buf, CTL_WRITE_0_CID_SID,
-		   &PFMCID, &PFMSID, &CID, &SID, &tag) == 5) {
-		incoming_slot->buflen = 0;	// buf received
-		spin_unlock(&(adapter->incoming_slot_lock));
-		adapter->core->PFMCID = PFMCID;
-		adapter->core->PFMSID = PFMSID;
-		adapter->core->CID0 = CID;
-		adapter->core->SID0 = SID;
-		adapter->core->PMCID = -1;
-		sprintf(outbuf, STANDALONE_ACKNOWLEDGMENT, tag);
-		FEE_create_outgoing(
-			incoming_slot->peer_id,
-			GENZ_FEE_SID_CID_IS_PEER_ID,
-			outbuf, strlen(outbuf),
-			adapter);
-		return IRQ_HANDLED;
+int FEE_link_init(struct FEE_adapter *adapter)
+{
+	INIT_LIST_HEAD(&adapter->rxq_link);
+	INIT_WORK(&adapter->link_work, link_worker);
+	if (!(adapter->link_wq = alloc_ordered_workqueue(
+			"%s.%02x", 0, FEE_NAME, adapter->slot))) {
+		pr_err(FEESP "Cannot allocate link workqueue\n");
+		return -ENOMEM;
 	}
+	return 0;
+}
 
-	return IRQ_NONE;
+// Interrupts must be gone by now so nothing new gets queued.
+
+void FEE_link_destroy(struct FEE_adapter *adapter)
+{
+	if (!adapter->link_wq)
+		return;
+	destroy_workqueue(adapter->link_wq);	// Drains it first
+	adapter->link_wq = NULL;
 }
@@ -0,0 +1,230 @@
+/*
+ * (C) Copyright 2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This source code file is part of the EmerGen-Z project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Loopback: IVSHMEM without QEMU.  With loopback_peers=N this kernel gets
+// N adapters sharing one vmalloc'ed "BAR2", laid out just like
+// ivshmsg_server.py does it (globals in slot 0, clients 1..N, the server
+// at N+1), each with its own "BAR0" holding IVPosition.  A Doorbell write
+// goes straight to the target adapter's handler (FEE_ISR_loop_ring()).
+// The bridge, link layer, counters, histograms and pingbench all work on
+// them as on the real thing, so any box (CI included) can run the stack.
+//
+// The server's mailslot is a sink: it takes whatever is sent to it at
+// once and rings the sender back.  Nothing a real switch would answer
+// is answered, which is all probe and the bridge need.
+
+#include <linux/platform_device.h>
+#include <linux/rcupdate.h>
+#include <linux/vmalloc.h>
+
+#include "fee.h"
+
+#define FEE_LOOP_NAME		"genz_fee_loop"
+#define FEE_LOOP_MAX_PEERS	64
+#define FEE_LOOP_SLOT(peer_id)	(0x40 + (peer_id))	// Above any PCI slot
+
+static struct {
+	struct FEE_globals *globals;			// The whole "BAR2"
+	struct ivshmem_registers *regs;			// "BAR0" by peer id
+	struct platform_device **pdevs;			// by peer id
+	struct FEE_adapter __rcu **adapters;		// by peer id
+	int npeers;
+} loop;
+
+//-------------------------------------------------------------------------
+// Called from ring_doorbell() after the register write, in whatever
+// context the sender was in.  RCU keeps the target around while it's
+// being rung.
+
+static void loop_switch(struct FEE_adapter *sender)
+{
+	struct FEE_mailslot *slot = sender->my_slot;
+	struct FEE_adapter *adapter;
+
+	// The server slot has no caps so nobody uses a ring to reach it.
+	if (slot->buflen && (!slot->caps ||
+			     slot->last_responder == loop.globals->server_id)) {
+		rmb();
+		slot->buflen = 0;
+	}
+	rcu_read_lock();
+	if ((adapter = rcu_dereference(loop.adapters[sender->my_id])))
+		FEE_ISR_loop_ring(adapter, loop.globals->server_id);
+	rcu_read_unlock();
+}
+
+void FEE_loop_doorbell(struct FEE_adapter *sender, uint32_t peer_id,
+		       uint16_t vector)
+{
+	struct FEE_adapter *adapter;
+
+	if (peer_id == loop.globals->server_id) {
+		loop_switch(sender);
+		return;
+	}
+	if (peer_id < 1 || peer_id > loop.npeers)
+		return;
+	rcu_read_lock();
+	if ((adapter = rcu_dereference(loop.adapters[peer_id])))
+		FEE_ISR_loop_ring(adapter, vector);
+	rcu_read_unlock();
+}
+
+//-------------------------------------------------------------------------
+// What ivshmsg_server.py does before any client shows up.
+
+static int loop_layout(void)
+{
+	uint64_t slotsize = round_down(loopback_slotsize, 32),
+		 nslots = roundup_pow_of_two(loop.npeers + 2), i;
+	struct FEE_mailslot *slot;
+
+	if (slotsize <= offsetof(struct FEE_mailslot, buf) + 32) {
+		pr_err(FEE "loopback_slotsize %d is too small\n",
+		       loopback_slotsize);
+		return -EINVAL;
+	}
+	if (!(loop.globals = vzalloc(nslots * slotsize)))
+		return -ENOMEM;
+	loop.globals->slotsize = slotsize;
+	loop.globals->buf_offset = offsetof(struct FEE_mailslot, buf);
+	loop.globals->nClients = loop.npeers;
+	loop.globals->nEvents = loop.npeers + 2;
+	loop.globals->server_id = loop.npeers + 1;
+
+	for (i = 1; i <= loop.globals->server_id; i++) {
+		slot = (void *)loop.globals + i * slotsize;
+		slot->peer_id = i;
+	}
+	strcpy(slot->nodename, "loopback");	// The server's
+	strcpy(slot->cclass, "Switch");
+	return 0;
+}
+
+// Same steps as FEE_init_one(), minus PCI and the peer attribute request
+// (the sink would never answer it).
+
+static int loop_add(int peer_id)
+{
+	struct platform_device *pdev;
+	struct FEE_adapter *adapter;
+	int ret;
+
+	pdev = platform_device_register_simple(FEE_LOOP_NAME, peer_id, NULL, 0);
+	if (IS_ERR(pdev))
+		return PTR_ERR(pdev);
+	loop.pdevs[peer_id] = pdev;
+	loop.regs[peer_id].IVPosition = peer_id;
+
+	adapter = FEE_adapter_create_loop(&pdev->dev, FEE_LOOP_SLOT(peer_id),
+					  &loop.regs[peer_id], loop.globals);
+	if (IS_ERR(adapter))
+		return PTR_ERR(adapter);
+	if ((ret = FEE_ISR_loop_setup(adapter)))
+		goto err_destroy_adapter;
+	if ((ret = FEE_sysfs_init(adapter))) {
+		pr_err(FEESP "sysfs group creation failed: %d\n", ret);
+		goto err_ISR_teardown;
+	}
+	FEE_debugfs_init(adapter);
+
+	down(&FEE_adapter_sema);
+	list_add_tail(&adapter->lister, &FEE_adapter_list);
+	up(&FEE_adapter_sema);
+	rcu_assign_pointer(loop.adapters[peer_id], adapter);
+	pr_info(FEE "loopback peer %d is %s\n", peer_id, dev_name(&pdev->dev));
+	return 0;
+
+err_ISR_teardown:
+	FEE_ISR_loop_teardown(adapter);
+
+err_destroy_adapter:
+	FEE_adapter_destroy(adapter);
+	return ret;
+}
+
+// Stop all doorbells first so nobody rings an adapter on its way out.
+
+void FEE_loop_exit(void)
+{
+	struct FEE_adapter *adapter;
+	int i;
+
+	if (!loop.adapters)		// Never got as far as loop_add()
+		goto free_all;
+	for (i = 1; i <= loop.npeers; i++)
+		RCU_INIT_POINTER(loop.adapters[i], NULL);
+	synchronize_rcu();
+
+	for (i = 1; i <= loop.npeers; i++) {
+		if (!loop.pdevs[i])
+			continue;
+		if ((adapter = platform_get_drvdata(loop.pdevs[i]))) {
+			down(&FEE_adapter_sema);
+			list_del(&adapter->lister);
+			up(&FEE_adapter_sema);
+			FEE_debugfs_destroy(adapter);
+			FEE_sysfs_destroy(adapter);
+			FEE_ISR_loop_teardown(adapter);
+			FEE_adapter_destroy(adapter);
+		}
+		platform_device_unregister(loop.pdevs[i]);
+	}
+
+free_all:
+	kfree(loop.adapters);
+	kfree(loop.pdevs);
+	kfree(loop.regs);
+	vfree(loop.globals);
+	memset(&loop, 0, sizeof(loop));
+}
+
+int FEE_loop_init(void)
+{
+	int i, ret;
+
+	if (loopback_peers <= 0)
+		return 0;
+	if (loopback_peers > FEE_LOOP_MAX_PEERS) {
+		pr_err(FEE "loopback_peers is at most %d\n", FEE_LOOP_MAX_PEERS);
+		return -EINVAL;
+	}
+	loop.npeers = loopback_peers;
+	if ((ret = loop_layout()))
+		goto err_loop_exit;
+
+	ret = -ENOMEM;
+	if (!(loop.regs = kcalloc(loop.npeers + 1, sizeof(*loop.regs),
+				  GFP_KERNEL)) ||
+	    !(loop.pdevs = kcalloc(loop.npeers + 1, sizeof(*loop.pdevs),
+				   GFP_KERNEL)) ||
+	    !(loop.adapters = kcalloc(loop.npeers + 1, sizeof(*loop.adapters),
+				      GFP_KERNEL)))
+		goto err_loop_exit;
+
+	for (i = 1; i <= loop.npeers; i++)
+		if ((ret = loop_add(i)))
+			goto err_loop_exit;
+	return 0;
+
+err_loop_exit:
+	FEE_loop_exit();
+	return ret;
+}
@@ -21,10 +21,17 @@
 // Initial discovery and setup of IVSHMEM/IVSHMSG devices
 // HP(E) lineage: res2hot from MMS PoC "mimosa" mms_base.c, flavored by zhpe.
 
+#include <linux/debugfs.h>
 #include <linux/module.h>
 
 #include "fee.h"
 
+#define CREATE_TRACE_POINTS
+#include "fee_trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(fee_bridge_read);
+EXPORT_TRACEPOINT_SYMBOL_GPL(fee_bridge_write);
+
 MODULE_LICENSE("GPL");
 MODULE_VERSION(FEE_VERSION);
 MODULE_AUTHOR("Rocky Craig <rocky.craig@hpe.com>");
@@ -51,6 +58,50 @@ int verbose = 0;
 module_param(verbose, uint, 0644);
 MODULE_PARM_DESC(verbose, "increase amount of printk info (0)");
 
+int bar2_map = FEE_BAR2_UC;
+module_param(bar2_map, int, 0444);
+MODULE_PARM_DESC(bar2_map, "mailslot mapping, 0 = uncached, 1 = write-combining, 2 = cached; send rings, credits and management need 0 (0)");
+
+int ring_entries = 8;
+module_param(ring_entries, int, 0444);
+MODULE_PARM_DESC(ring_entries, "send ring entries per mailslot, < 2 disables (8)");
+
+int rxq_depth = 64;
+module_param(rxq_depth, int, 0444);
+MODULE_PARM_DESC(rxq_depth, "receive queue entries per adapter (64)");
+
+int rx_credits = 0;
+module_param(rx_credits, int, 0444);
+MODULE_PARM_DESC(rx_credits, "messages each peer may have queued here, 0 = share of rxq_depth, -1 disables (0)");
+
+int mgmt_channel = 1;
+module_param(mgmt_channel, int, 0444);
+MODULE_PARM_DESC(mgmt_channel, "link management on its own ring and vector, ahead of data (1)");
+
+int rx_budget = 64;
+module_param(rx_budget, int, 0644);
+MODULE_PARM_DESC(rx_budget, "messages per receive poll, 0 delivers in the ISR (64)");
+
+int rx_moder_usecs = 50;
+module_param(rx_moder_usecs, int, 0644);
+MODULE_PARM_DESC(rx_moder_usecs, "max receive poll linger after a burst, 0 disables (50)");
+
+int frag_max_mb = 16;
+module_param(frag_max_mb, int, 0644);
+MODULE_PARM_DESC(frag_max_mb, "largest message sent or reassembled in pieces, MB (16)");
+
+int frag_budget_mb = 64;
+module_param(frag_budget_mb, int, 0644);
+MODULE_PARM_DESC(frag_budget_mb, "most an adapter holds in messages being (or just) reassembled, MB (64)");
+
+int loopback_peers = 0;
+module_param(loopback_peers, int, 0444);
+MODULE_PARM_DESC(loopback_peers, "software-only adapters talking among themselves (0)");
+
+int loopback_slotsize = 16384;
+module_param(loopback_slotsize, int, 0444);
+MODULE_PARM_DESC(loopback_slotsize, "mailslot bytes for loopback adapters (16384)");
+
 // Multiple bridge "devices" accepted by FEE_init_one().  PCI core might
 // do everything I need but I can't shake the feeling I want this for
 // something else...right now it just tracks insmod/rmmod.
@@ -101,13 +152,19 @@ static int FEE_init_one(
 
 	if ((ret = FEE_ISR_setup(pdev)))
 		goto err_pci_disable_device;
+	if ((ret = FEE_sysfs_init(adapter))) {
+		pr_err(FEESP "sysfs group creation failed: %d\n", ret);
+		goto err_MSIX_teardown;
+	}
+	FEE_debugfs_init(adapter);
 
 	// It's a keeper...unless it's already there.  Unlikely, but it's
 	// not paranoia when in the kernel.
 	ret = down_interruptible(&FEE_adapter_sema);	// FIXME: deal with ret
 	ret = 0;
 	list_for_each_entry(cur, &FEE_adapter_list, lister) {
-		if (STREQ(CARDLOC(pdev), pci_resource_name(cur->pdev, 1))) {
+		if (cur->pdev &&
+		    STREQ(CARDLOC(pdev), pci_resource_name(cur->pdev, 1))) {
 			ret = -EALREADY;
 			break;
 		}
@@ -128,12 +185,12 @@ static int FEE_init_one(
 	up(&FEE_adapter_sema);
 	if (ret) {
 		pr_err(FEESP "This device is already in active list\n");
-		goto err_MSIX_teardown;
+		goto err_sysfs_destroy;
 	}
 
 
 	// Get peer-attributes from ivshmsg_server; response processed inline
-	ret = FEE_create_outgoing(
+	ret = FEE_create_mgmt(
 		adapter->globals->server_id,
 		GENZ_FEE_SID_CID_IS_PEER_ID,
 		get_peer_attributes, strlen(get_peer_attributes), adapter);
@@ -144,6 +201,10 @@ static int FEE_init_one(
 		return ret;	// else fall through
 	}
 
+err_sysfs_destroy:
+	FEE_debugfs_destroy(adapter);
+	FEE_sysfs_destroy(adapter);
+
 err_MSIX_teardown:
 	PR_V1("tearing down MSI-X %s\n", CARDLOC(pdev));
 	FEE_ISR_teardown(pdev);
@@ -180,8 +241,14 @@ static void FEE_remove_one(struct pci_dev *pdev)
 	strcpy(adapter->my_slot->cclass, "Driverless QEMU");
 	UPDATE_SWITCH(adapter);
 
+	FEE_debugfs_destroy(adapter);
+	FEE_sysfs_destroy(adapter);
 	FEE_ISR_teardown(pdev);
 
+	// Peers stop ringing back.  Not before the poll timer is gone: it
+	// flips NOTIFY_OFF in the same word with atomic bitops.
+	WRITE_ONCE(adapter->my_slot->caps, 0);
+
 	pci_disable_device(pdev);
 
 	if (atomic_read(&adapter->nr_users))
@@ -189,7 +256,7 @@ static void FEE_remove_one(struct pci_dev *pdev)
 	
 	ret = down_interruptible(&FEE_adapter_sema);	// FIXME: deal with ret
 	list_for_each_entry_safe(cur, next, &FEE_adapter_list, lister) {
-		if (STREQ(CARDLOC(cur->pdev), CARDLOC(pdev)))
+		if (cur->pdev && STREQ(CARDLOC(cur->pdev), CARDLOC(pdev)))
 			list_del(&(cur->lister));
 	}
 	up(&FEE_adapter_sema);
@@ -213,10 +280,38 @@ int __init FEE_init(void)
 	pr_info("-------------------------------------------------------");
 	pr_info(FEE FEE_VERSION "; parms:\n");
 	pr_info(FEESP "verbose = %d\n", verbose);
-
-	if ((ret = pci_register_driver(&FEE_driver)))
+	pr_info(FEESP "bar2_map = %d\n", bar2_map);
+	pr_info(FEESP "ring_entries = %d\n", ring_entries);
+	pr_info(FEESP "rxq_depth = %d\n", rxq_depth);
+	pr_info(FEESP "rx_credits = %d\n", rx_credits);
+	pr_info(FEESP "mgmt_channel = %d\n", mgmt_channel);
+	pr_info(FEESP "rx_budget = %d\n", rx_budget);
+	pr_info(FEESP "rx_moder_usecs = %d\n", rx_moder_usecs);
+	pr_info(FEESP "frag_max_mb = %d\n", frag_max_mb);
+	pr_info(FEESP "frag_budget_mb = %d\n", frag_budget_mb);
+	pr_info(FEESP "loopback_peers = %d\n", loopback_peers);
+	pr_info(FEESP "loopback_slotsize = %d\n", loopback_slotsize);
+
+	if (bar2_map < 0 || bar2_map >= FEE_BAR2_NMAPS) {
+		pr_err(FEE "bar2_map %d is not 0, 1 or 2\n", bar2_map);
+		return -EINVAL;
+	}
+	FEE_debugfs_root = debugfs_create_dir("genz_fee", NULL);
+	if ((ret = pci_register_driver(&FEE_driver))) {
 		pr_err(FEE "pci_register_driver() = %d\n", ret);
+		goto err_debugfs_remove;
+	}
+	if ((ret = FEE_loop_init())) {
+		pr_err(FEE "loopback setup failed: %d\n", ret);
+		goto err_pci_unregister;
+	}
+	return 0;
+
+err_pci_unregister:
+	pci_unregister_driver(&FEE_driver);
 
+err_debugfs_remove:
+	debugfs_remove_recursive(FEE_debugfs_root);
 	return ret;
 }
 
@@ -227,7 +322,9 @@ module_init(FEE_init);
 
 void FEE_exit(void)
 {
+	FEE_loop_exit();
 	pci_unregister_driver(&FEE_driver);
+	debugfs_remove_recursive(FEE_debugfs_root);
 }
 
 module_exit(FEE_exit);
@@ -0,0 +1,279 @@
+/*
+ * (C) Copyright 2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This source code file is part of the EmerGen-Z project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Kernel-only IVSHMSG round trip baseline: "ping" a peer, whose link layer
+// answers "pong" (see fee_link.c), and time it.  Peers that advertise
+// FEE_CAP_BINLINK get the binary forms.  Nothing in user space
+// is on the path so runs are comparable across kernel and driver upgrades.
+//
+//	echo "<peer id> <count> [<burst>]" > .../genz_fee/<device>/pingbench
+//	cat .../genz_fee/<device>/pingbench
+//
+// The write runs the whole thing and returns when it's done (or fails).
+// A burst sends that many pings back to back, then waits for all of their
+// pongs; 1 (the default) is strict ping-pong.  The link layer answers in
+// order so the Nth pong goes with the Nth ping.
+
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "fee.h"
+
+#define PINGBENCH_TIMEOUT	(2 * HZ)	// For one burst's pongs
+
+void FEE_pingbench_init(struct FEE_adapter *adapter)
+{
+	struct FEE_pingbench *pb = &adapter->pingbench;
+
+	mutex_init(&pb->run_lock);
+	spin_lock_init(&pb->match_lock);
+	init_waitqueue_head(&pb->wqh);
+}
+
+//-------------------------------------------------------------------------
+// Called by the deliverer for every message before it is copied.  True
+// means it was a pong for the current run and the caller just releases it.
+// A pong nobody asked for (late, after a timeout) goes to readers.
+
+bool FEE_pingbench_pong(struct FEE_adapter *adapter, struct FEE_rxmsg *msg)
+{
+	struct FEE_pingbench *pb = &adapter->pingbench;
+	u64 now = ktime_get_ns();
+	unsigned long flags;
+	bool mine = false;
+
+	if (!READ_ONCE(pb->running) || READ_ONCE(pb->peer_id) != msg->peer_id)
+		return false;
+	if (!FEE_link_is(msg->buf, msg->buflen, GENZ_LINK_PONG) &&
+	    (msg->buflen != 4 || !STREQ_N(msg->buf, "pong", 4)))
+		return false;
+
+	spin_lock_irqsave(&pb->match_lock, flags);
+	if (pb->running && pb->peer_id == msg->peer_id &&
+	    pb->rcvd < pb->sent) {
+		pb->rtt_ns[pb->rcvd] = now - pb->sent_ns[pb->rcvd];
+		pb->rcvd++;
+		mine = true;
+	}
+	spin_unlock_irqrestore(&pb->match_lock, flags);
+	if (mine)
+		wake_up(&pb->wqh);
+	return mine;
+}
+
+//-------------------------------------------------------------------------
+
+static bool all_ponged(struct FEE_pingbench *pb)
+{
+	bool done;
+
+	spin_lock_irq(&pb->match_lock);
+	done = pb->rcvd == pb->sent;
+	spin_unlock_irq(&pb->match_lock);
+	return done;
+}
+
+static int ping(struct FEE_adapter *adapter, uint32_t peer_id)
+{
+	struct FEE_pingbench *pb = &adapter->pingbench;
+	bool binary = adapter->peers[peer_id].slot->caps & FEE_CAP_BINLINK;
+	struct FEE_txmsg tx;
+	int ret;
+
+	if ((ret = FEE_reserve_outgoing(
+			peer_id, GENZ_FEE_SID_CID_IS_PEER_ID,
+			binary ? sizeof(struct genz_link_header_format) : 4,
+			adapter, 0, &tx)))
+		return ret;
+	if (binary)
+		FEE_link_header(tx.buf, GENZ_LINK_PING);
+	else
+		memcpy(tx.buf, "ping", 4);
+
+	// Stamp after getting space, so waiting for it only counts when the
+	// pipeline is full, as it would for any sender.
+	spin_lock_irq(&pb->match_lock);
+	pb->sent_ns[pb->sent++] = ktime_get_ns();
+	spin_unlock_irq(&pb->match_lock);
+
+	ret = FEE_commit_outgoing(adapter, &tx, 1);
+	return ret < 0 ? ret : 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Percentiles are exact, from the sorted samples.
+
+static void summarize(struct FEE_pingbench *pb, uint32_t count)
+{
+	u64 sum = 0;
+	uint32_t i;
+
+	sort(pb->rtt_ns, count, sizeof(u64), cmp_u64, NULL);
+	for (i = 0; i < count; i++)
+		sum += pb->rtt_ns[i];
+	pb->result.min = pb->rtt_ns[0];
+	pb->result.avg = div_u64(sum, count);
+	pb->result.p50 = pb->rtt_ns[div_u64((u64)count * 500, 1000)];
+	pb->result.p99 = pb->rtt_ns[div_u64((u64)count * 990, 1000)];
+	pb->result.p999 = pb->rtt_ns[div_u64((u64)count * 999, 1000)];
+}
+
+static int run(struct FEE_adapter *adapter, uint32_t peer_id,
+	       uint32_t count, uint32_t burst)
+{
+	struct FEE_pingbench *pb = &adapter->pingbench;
+	uint32_t i, n;
+	u64 start;
+	long waited;
+	int ret = 0;
+
+	pb->sent_ns = vmalloc(count * sizeof(u64));
+	pb->rtt_ns = vmalloc(count * sizeof(u64));
+	if (!pb->sent_ns || !pb->rtt_ns) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	spin_lock_irq(&pb->match_lock);
+	pb->peer_id = peer_id;
+	pb->sent = pb->rcvd = 0;
+	pb->running = true;
+	spin_unlock_irq(&pb->match_lock);
+
+	start = ktime_get_ns();
+	for (i = 0; i < count; ) {
+		for (n = min(burst, count - i); n; n--, i++)
+			if ((ret = ping(adapter, peer_id)))
+				goto out_stop;
+		waited = wait_event_interruptible_timeout(
+			pb->wqh, all_ponged(pb), PINGBENCH_TIMEOUT);
+		if (waited < 0) {
+			ret = waited;
+			goto out_stop;
+		}
+		if (!waited) {
+			pr_err(FEE "pingbench: peer %u stopped answering after %u\n",
+			       peer_id, pb->rcvd);
+			ret = -ETIMEDOUT;
+			goto out_stop;
+		}
+	}
+	pb->result.elapsed_ns = ktime_get_ns() - start;
+
+out_stop:
+	spin_lock_irq(&pb->match_lock);
+	pb->running = false;
+	spin_unlock_irq(&pb->match_lock);
+	if (!ret)
+		summarize(pb, count);
+
+out_free:
+	vfree(pb->sent_ns);
+	vfree(pb->rtt_ns);
+	pb->sent_ns = pb->rtt_ns = NULL;
+	return ret;
+}
+
+//-------------------------------------------------------------------------
+
+static int pingbench_show(struct seq_file *seq, void *unused)
+{
+	struct FEE_adapter *adapter = seq->private;
+	struct FEE_pingbench *pb = &adapter->pingbench;
+	int ret;
+
+	if ((ret = mutex_lock_interruptible(&pb->run_lock)))
+		return ret;
+	if (!pb->result.count) {
+		seq_puts(seq, "usage: echo \"<peer id> <count> [<burst>]\" > pingbench\n");
+	} else if (pb->result.ret) {
+		seq_printf(seq, "peer %u count %u burst %u failed %d\n",
+			   pb->result.peer_id, pb->result.count,
+			   pb->result.burst, pb->result.ret);
+	} else {
+		seq_printf(seq, "peer %u count %u burst %u\n",
+			   pb->result.peer_id, pb->result.count,
+			   pb->result.burst);
+		seq_printf(seq, "rtt_ns min %llu avg %llu p50 %llu p99 %llu p99.9 %llu\n",
+			   pb->result.min, pb->result.avg, pb->result.p50,
+			   pb->result.p99, pb->result.p999);
+		seq_printf(seq, "round_trips/s %llu\n",
+			   div64_u64((u64)pb->result.count * NSEC_PER_SEC,
+				     pb->result.elapsed_ns ? : 1));
+	}
+	mutex_unlock(&pb->run_lock);
+	return 0;
+}
+
+static int pingbench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pingbench_show, inode->i_private);
+}
+
+static ssize_t pingbench_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct FEE_adapter *adapter = ((struct seq_file *)file->private_data)->private;
+	struct FEE_pingbench *pb = &adapter->pingbench;
+	uint32_t peer_id, npings, burst = 1;
+	char cmd[64];
+	int ret;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+	if (sscanf(cmd, "%u %u %u", &peer_id, &npings, &burst) < 2)
+		return -EINVAL;
+	if (peer_id >= adapter->globals->nEvents || peer_id == adapter->my_id ||
+	    !adapter->peers[peer_id].slot ||
+	    !npings || npings > FEE_PINGBENCH_MAX || !burst)
+		return -EINVAL;
+
+	if ((ret = mutex_lock_interruptible(&pb->run_lock)))
+		return ret;
+	memset(&pb->result, 0, sizeof(pb->result));
+	ret = run(adapter, peer_id, npings, min(burst, npings));
+	pb->result.ret = ret;
+	pb->result.peer_id = peer_id;
+	pb->result.count = npings;
+	pb->result.burst = min(burst, npings);
+	mutex_unlock(&pb->run_lock);
+	return ret ? ret : count;
+}
+
+const struct file_operations FEE_pingbench_fops = {
+	.owner =	THIS_MODULE,
+	.open =		pingbench_open,
+	.read =		seq_read,
+	.write =	pingbench_write,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
@@ -50,7 +50,7 @@ int FEE_register(const struct genz_core_structure *core,
 
 		// Device file name is meant to be reminiscent of lspci output.
 		pr_info(FEE "binding %s to %s:\n",
-			ownername, pci_resource_name(adapter->pdev, 1));
+			ownername, dev_name(adapter->dev));
 
 		adapter->genz_chrdev = genz_register_char_device(
 			core, fops, adapter, attr, adapter->slot);
@@ -97,7 +97,7 @@ int FEE_unregister(const struct file_operations *fops)
 	list_for_each_entry(adapter, &FEE_adapter_list, lister) {
 
 		pr_info(FEE "UNbind %s from %s: ",
-			fops->owner->name, pci_resource_name(adapter->pdev, 0));
+			fops->owner->name, dev_name(adapter->dev));
 
 		if (adapter->genz_chrdev &&
 		    adapter->genz_chrdev->cdev.ops == fops) {
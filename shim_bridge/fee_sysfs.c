@@ -0,0 +1,347 @@
+/*
+ * (C) Copyright 2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This source code file is part of the EmerGen-Z project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Per-adapter knobs and counters under the IVSHMEM PCI device, ie,
+// /sys/bus/pci/devices/0000:00:xx.0/fee{,_stats,_peers}/, or under
+// /sys/devices/platform/genz_fee_loop.N/ for loopback.  The drvdata there
+// is the adapter.
+
+#include <linux/device.h>
+#include <linux/jiffies.h>
+#include <linux/kobject.h>
+#include <linux/percpu.h>
+#include <linux/sysfs.h>
+
+#include "fee.h"
+
+//-------------------------------------------------------------------------
+// Default busy-poll for readers of this adapter, see FEE_busy_poll().
+// A bridge fd can override it with GF_BRIDGE_IOC_BUSYPOLL.
+
+static ssize_t busy_poll_usecs_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct FEE_adapter *adapter = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+			 READ_ONCE(adapter->busy_poll_usecs));
+}
+
+static ssize_t busy_poll_usecs_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct FEE_adapter *adapter = dev_get_drvdata(dev);
+	unsigned usecs;
+	int ret;
+
+	if ((ret = kstrtouint(buf, 0, &usecs)))
+		return ret;
+	if (usecs > FEE_BUSY_POLL_MAX_USECS)
+		return -ERANGE;
+	WRITE_ONCE(adapter->busy_poll_usecs, usecs);
+	return count;
+}
+static DEVICE_ATTR_RW(busy_poll_usecs);
+
+static ssize_t busy_poll_hybrid_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct FEE_adapter *adapter = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+			 READ_ONCE(adapter->busy_poll_hybrid));
+}
+
+static ssize_t busy_poll_hybrid_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct FEE_adapter *adapter = dev_get_drvdata(dev);
+	int ret, hybrid;
+
+	if ((ret = kstrtoint(buf, 0, &hybrid)))
+		return ret;
+	WRITE_ONCE(adapter->busy_poll_hybrid, !!hybrid);
+	return count;
+}
+static DEVICE_ATTR_RW(busy_poll_hybrid);
+
+// How BAR2 ended up mapped: insmod bar2_map, unless that failed.  It
+// can't change under live mailslots, so read-only.
+
+static ssize_t bar2_map_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct FEE_adapter *adapter = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%s\n",
+			 FEE_bar2_map_names[adapter->bar2_map]);
+}
+static DEVICE_ATTR_RO(bar2_map);
+
+//-------------------------------------------------------------------------
+// Counters, one read-only file each.  Every CPU's copy is summed on read
+// so a value can be a few events stale but never goes backwards.
+
+struct FEE_counter_attribute {
+	struct device_attribute dattr;
+	enum FEE_counter which;
+};
+
+static ssize_t counter_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct FEE_adapter *adapter = dev_get_drvdata(dev);
+	enum FEE_counter which = container_of(
+		attr, struct FEE_counter_attribute, dattr)->which;
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(adapter->stats, cpu)->c[which];
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", sum);
+}
+
+#define FEE_COUNTER_ATTR(_name, _which)					\
+static struct FEE_counter_attribute counter_##_name = {			\
+	.dattr = __ATTR(_name, 0444, counter_show, NULL),		\
+	.which = _which,						\
+}
+
+FEE_COUNTER_ATTR(tx_msgs, FEE_CNT_TX_MSGS);
+FEE_COUNTER_ATTR(tx_bytes, FEE_CNT_TX_BYTES);
+FEE_COUNTER_ATTR(rx_msgs, FEE_CNT_RX_MSGS);
+FEE_COUNTER_ATTR(rx_bytes, FEE_CNT_RX_BYTES);
+FEE_COUNTER_ATTR(tx_stomps, FEE_CNT_TX_STOMPS);
+FEE_COUNTER_ATTR(rx_drops, FEE_CNT_RX_DROPS);
+FEE_COUNTER_ATTR(tx_timeouts, FEE_CNT_TX_TIMEOUTS);
+FEE_COUNTER_ATTR(tx_restarts, FEE_CNT_TX_RESTARTS);
+FEE_COUNTER_ATTR(link_msgs, FEE_CNT_LINK_MSGS);
+FEE_COUNTER_ATTR(doorbells, FEE_CNT_DOORBELLS);
+FEE_COUNTER_ATTR(doorbells_skipped, FEE_CNT_DOORBELLS_SKIPPED);
+FEE_COUNTER_ATTR(irqs, FEE_CNT_IRQS);
+FEE_COUNTER_ATTR(rx_polls, FEE_CNT_RX_POLLS);
+FEE_COUNTER_ATTR(rx_reasm, FEE_CNT_RX_REASM);
+FEE_COUNTER_ATTR(rx_reasm_drops, FEE_CNT_RX_REASM_DROPS);
+FEE_COUNTER_ATTR(tx_credit_waits, FEE_CNT_TX_CREDIT_WAITS);
+FEE_COUNTER_ATTR(rx_mgmt, FEE_CNT_RX_MGMT);
+
+// Longest wait for send space, the old driver-wide "longest" timeout.
+
+static ssize_t tx_wait_longest_ms_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct FEE_adapter *adapter = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+			 jiffies_to_msecs(READ_ONCE(adapter->tx_wait_longest)));
+}
+static DEVICE_ATTR_RO(tx_wait_longest_ms);
+
+static struct attribute *FEE_stats_attrs[] = {
+	&counter_tx_msgs.dattr.attr,
+	&counter_tx_bytes.dattr.attr,
+	&counter_rx_msgs.dattr.attr,
+	&counter_rx_bytes.dattr.attr,
+	&counter_tx_stomps.dattr.attr,
+	&counter_rx_drops.dattr.attr,
+	&counter_tx_timeouts.dattr.attr,
+	&counter_tx_restarts.dattr.attr,
+	&counter_link_msgs.dattr.attr,
+	&counter_doorbells.dattr.attr,
+	&counter_doorbells_skipped.dattr.attr,
+	&counter_irqs.dattr.attr,
+	&counter_rx_polls.dattr.attr,
+	&counter_rx_reasm.dattr.attr,
+	&counter_rx_reasm_drops.dattr.attr,
+	&counter_tx_credit_waits.dattr.attr,
+	&counter_rx_mgmt.dattr.attr,
+	&dev_attr_tx_wait_longest_ms.attr,
+	NULL
+};
+
+static const struct attribute_group FEE_stats_group = {
+	.name = "fee_stats",
+	.attrs = FEE_stats_attrs,
+};
+
+//-------------------------------------------------------------------------
+// Per-peer traffic in fee_peers/<peer id>/.  The directories are bare
+// kobjects: the peer id is the name and the adapter hangs off the PCI
+// device two levels up.
+
+struct FEE_peer_attribute {
+	struct kobj_attribute kattr;
+	enum FEE_peer_counter which;
+};
+
+static ssize_t peer_counter_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	struct FEE_adapter *adapter = dev_get_drvdata(
+		kobj_to_dev(kobj->parent->parent));
+	enum FEE_peer_counter which = container_of(
+		attr, struct FEE_peer_attribute, kattr)->which;
+	unsigned peer_id;
+	u64 sum = 0;
+	int cpu;
+
+	if (kstrtouint(kobject_name(kobj), 10, &peer_id) ||
+	    peer_id >= adapter->globals->nEvents)
+		return -ENXIO;
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(adapter->peer_stats, cpu)[peer_id].c[which];
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", sum);
+}
+
+#define FEE_PEER_ATTR(_name, _which)					\
+static struct FEE_peer_attribute peer_##_name = {			\
+	.kattr = __ATTR(_name, 0444, peer_counter_show, NULL),		\
+	.which = _which,						\
+}
+
+FEE_PEER_ATTR(tx_msgs, FEE_PCNT_TX_MSGS);
+FEE_PEER_ATTR(tx_bytes, FEE_PCNT_TX_BYTES);
+FEE_PEER_ATTR(rx_msgs, FEE_PCNT_RX_MSGS);
+FEE_PEER_ATTR(rx_bytes, FEE_PCNT_RX_BYTES);
+
+// Not a counter: sends I can make before the peer releases some, or -1
+// if it doesn't do flow control.
+
+static ssize_t tx_credits_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	struct FEE_adapter *adapter = dev_get_drvdata(
+		kobj_to_dev(kobj->parent->parent));
+	unsigned peer_id;
+
+	if (kstrtouint(kobject_name(kobj), 10, &peer_id) ||
+	    peer_id >= adapter->globals->nEvents)
+		return -ENXIO;
+	return scnprintf(buf, PAGE_SIZE, "%lld\n",
+			 FEE_credit_left(adapter, peer_id));
+}
+static struct kobj_attribute peer_tx_credits = __ATTR_RO(tx_credits);
+
+static struct attribute *FEE_peer_attrs[] = {
+	&peer_tx_msgs.kattr.attr,
+	&peer_tx_bytes.kattr.attr,
+	&peer_rx_msgs.kattr.attr,
+	&peer_rx_bytes.kattr.attr,
+	&peer_tx_credits.attr,
+	NULL
+};
+
+static const struct attribute_group FEE_peer_group = {
+	.attrs = FEE_peer_attrs,
+};
+
+static void peers_destroy(struct FEE_adapter *adapter)
+{
+	int i;
+
+	if (!adapter->peers_kobj)
+		return;
+	for (i = 0; i < adapter->globals->nEvents; i++) {
+		if (!adapter->peers[i].kobj)
+			continue;
+		sysfs_remove_group(adapter->peers[i].kobj, &FEE_peer_group);
+		kobject_put(adapter->peers[i].kobj);
+		adapter->peers[i].kobj = NULL;
+	}
+	kobject_put(adapter->peers_kobj);
+	adapter->peers_kobj = NULL;
+}
+
+// Every mailslot that can send, including the server's and my own (which
+// stays zero unless somebody loops back).
+
+static int peers_init(struct FEE_adapter *adapter)
+{
+	struct kobject *kobj;
+	char name[8];
+	int i, ret;
+
+	if (!(adapter->peers_kobj = kobject_create_and_add(
+			"fee_peers", &adapter->dev->kobj)))
+		return -ENOMEM;
+	for (i = 0; i < adapter->globals->nEvents; i++) {
+		if (!adapter->peers[i].slot)
+			continue;
+		snprintf(name, sizeof(name), "%d", i);
+		if (!(kobj = kobject_create_and_add(name, adapter->peers_kobj))) {
+			ret = -ENOMEM;
+			goto err_peers_destroy;
+		}
+		adapter->peers[i].kobj = kobj;
+		if ((ret = sysfs_create_group(kobj, &FEE_peer_group)))
+			goto err_peers_destroy;
+	}
+	return 0;
+
+err_peers_destroy:
+	peers_destroy(adapter);
+	return ret;
+}
+
+//-------------------------------------------------------------------------
+
+static struct attribute *FEE_attrs[] = {
+	&dev_attr_busy_poll_usecs.attr,
+	&dev_attr_busy_poll_hybrid.attr,
+	&dev_attr_bar2_map.attr,
+	NULL
+};
+
+static const struct attribute_group FEE_attr_group = {
+	.name = "fee",
+	.attrs = FEE_attrs,
+};
+
+int FEE_sysfs_init(struct FEE_adapter *adapter)
+{
+	struct kobject *kobj = &adapter->dev->kobj;
+	int ret;
+
+	if ((ret = sysfs_create_group(kobj, &FEE_attr_group)))
+		return ret;
+	if ((ret = sysfs_create_group(kobj, &FEE_stats_group)))
+		goto err_remove_attr_group;
+	if ((ret = peers_init(adapter)))
+		goto err_remove_stats_group;
+	return 0;
+
+err_remove_stats_group:
+	sysfs_remove_group(kobj, &FEE_stats_group);
+
+err_remove_attr_group:
+	sysfs_remove_group(kobj, &FEE_attr_group);
+	return ret;
+}
+
+void FEE_sysfs_destroy(struct FEE_adapter *adapter)
+{
+	struct kobject *kobj = &adapter->dev->kobj;
+
+	peers_destroy(adapter);
+	sysfs_remove_group(kobj, &FEE_stats_group);
+	sysfs_remove_group(kobj, &FEE_attr_group);
+}
@@ -0,0 +1,199 @@
+/*
+ * (C) Copyright 2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This source code file is part of the EmerGen-Z project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Tracepoints along a message's path, for ftrace/perf/bpftrace:
+//	fee_send -> fee_doorbell -> (peer) fee_irq -> fee_rx -> fee_recv
+// plus fee_link for link requests answered here and fee_bridge_xxx at
+// the system call end.  Every event carries the adapter (PCI slot) and
+// the peer.  Instantiated in fee_pci.c; the bridge ones are exported.
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fee
+
+#if !defined(FEE_TRACE_DOT_H) || defined(TRACE_HEADER_MULTI_READ)
+#define FEE_TRACE_DOT_H
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+#include "fee.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define FEE_ASSIGN_STR(field, src)	__assign_str(field)
+#else
+#define FEE_ASSIGN_STR(field, src)	__assign_str(field, src)
+#endif
+
+// Sends go by peer id; CID,SID are derived the same way claim_from_peer()
+// does for the receiver.
+
+TRACE_EVENT(fee_send,
+	TP_PROTO(struct FEE_adapter *adapter, struct FEE_txmsg *tx),
+	TP_ARGS(adapter, tx),
+	TP_STRUCT__entry(
+		__field(int, slot)
+		__field(uint32_t, peer_id)
+		__field(uint32_t, cid)
+		__field(uint32_t, sid)
+		__field(size_t, len)
+		__field(bool, ring)
+	),
+	TP_fast_assign(
+		__entry->slot = adapter->slot;
+		__entry->peer_id = tx->peer_id;
+		__entry->cid = tx->peer_id * 100;
+		__entry->sid = GENZ_FEE_SID_DEFAULT;
+		__entry->len = tx->buflen;
+		__entry->ring = tx->entry != NULL;
+	),
+	TP_printk("slot=%02x peer=%u cid=%u sid=%u len=%zu %s",
+		__entry->slot, __entry->peer_id, __entry->cid, __entry->sid,
+		__entry->len, __entry->ring ? "ring" : "legacy")
+);
+
+TRACE_EVENT(fee_doorbell,
+	TP_PROTO(struct FEE_adapter *adapter, uint32_t peer_id, bool skipped),
+	TP_ARGS(adapter, peer_id, skipped),
+	TP_STRUCT__entry(
+		__field(int, slot)
+		__field(uint32_t, peer_id)
+		__field(bool, skipped)
+	),
+	TP_fast_assign(
+		__entry->slot = adapter->slot;
+		__entry->peer_id = peer_id;
+		__entry->skipped = skipped;
+	),
+	TP_printk("slot=%02x peer=%u%s", __entry->slot, __entry->peer_id,
+		__entry->skipped ? " skipped (peer polling)" : "")
+);
+
+// The doorbell says nothing about how much is waiting; fee_rx has that.
+
+TRACE_EVENT(fee_irq,
+	TP_PROTO(struct FEE_adapter *adapter, int vector, uint16_t peer_id),
+	TP_ARGS(adapter, vector, peer_id),
+	TP_STRUCT__entry(
+		__field(int, slot)
+		__field(int, vector)
+		__field(uint16_t, peer_id)
+	),
+	TP_fast_assign(
+		__entry->slot = adapter->slot;
+		__entry->vector = vector;
+		__entry->peer_id = peer_id;
+	),
+	TP_printk("slot=%02x vector=%d peer=%u",
+		__entry->slot, __entry->vector, __entry->peer_id)
+);
+
+DECLARE_EVENT_CLASS(fee_rxmsg_class,
+	TP_PROTO(struct FEE_adapter *adapter, struct FEE_rxmsg *msg),
+	TP_ARGS(adapter, msg),
+	TP_STRUCT__entry(
+		__field(int, slot)
+		__field(uint64_t, peer_id)
+		__field(uint64_t, cid)
+		__field(uint64_t, sid)
+		__field(uint64_t, len)
+	),
+	TP_fast_assign(
+		__entry->slot = adapter->slot;
+		__entry->peer_id = msg->peer_id;
+		__entry->cid = msg->peer_CID;
+		__entry->sid = msg->peer_SID;
+		__entry->len = msg->buflen;
+	),
+	TP_printk("slot=%02x peer=%llu cid=%llu sid=%llu len=%llu",
+		__entry->slot, __entry->peer_id, __entry->cid, __entry->sid,
+		__entry->len)
+);
+
+// Copied out of the sender's space into the receive queue.
+DEFINE_EVENT(fee_rxmsg_class, fee_rx,
+	TP_PROTO(struct FEE_adapter *adapter, struct FEE_rxmsg *msg),
+	TP_ARGS(adapter, msg)
+);
+
+// Taken off the queue by a (possibly just woken) reader.
+DEFINE_EVENT(fee_rxmsg_class, fee_recv,
+	TP_PROTO(struct FEE_adapter *adapter, struct FEE_rxmsg *msg),
+	TP_ARGS(adapter, msg)
+);
+
+TRACE_EVENT(fee_link,
+	TP_PROTO(struct FEE_adapter *adapter, struct FEE_rxmsg *msg,
+		 const char *type),
+	TP_ARGS(adapter, msg, type),
+	TP_STRUCT__entry(
+		__field(int, slot)
+		__field(uint64_t, peer_id)
+		__field(uint64_t, len)
+		__string(type, type)
+	),
+	TP_fast_assign(
+		__entry->slot = adapter->slot;
+		__entry->peer_id = msg->peer_id;
+		__entry->len = msg->buflen;
+		FEE_ASSIGN_STR(type, type);
+	),
+	TP_printk("slot=%02x peer=%llu len=%llu %s",
+		__entry->slot, __entry->peer_id, __entry->len, __get_str(type))
+);
+
+// ret is the byte count (header included) or -errno.
+
+DECLARE_EVENT_CLASS(fee_bridge_class,
+	TP_PROTO(struct FEE_adapter *adapter, int cid, int sid, long ret),
+	TP_ARGS(adapter, cid, sid, ret),
+	TP_STRUCT__entry(
+		__field(int, slot)
+		__field(int, cid)
+		__field(int, sid)
+		__field(long, ret)
+	),
+	TP_fast_assign(
+		__entry->slot = adapter->slot;
+		__entry->cid = cid;
+		__entry->sid = sid;
+		__entry->ret = ret;
+	),
+	TP_printk("slot=%02x cid=%d sid=%d ret=%ld",
+		__entry->slot, __entry->cid, __entry->sid, __entry->ret)
+);
+
+DEFINE_EVENT(fee_bridge_class, fee_bridge_read,
+	TP_PROTO(struct FEE_adapter *adapter, int cid, int sid, long ret),
+	TP_ARGS(adapter, cid, sid, ret)
+);
+
+DEFINE_EVENT(fee_bridge_class, fee_bridge_write,
+	TP_PROTO(struct FEE_adapter *adapter, int cid, int sid, long ret),
+	TP_ARGS(adapter, cid, sid, ret)
+);
+
+#endif
+
+// This part must be outside the multi-read protection.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fee_trace
+#include <trace/define_trace.h>
@@ -25,7 +25,11 @@
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/poll.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/version.h>
 #include <linux/wait.h>
 
 #include <asm-generic/bug.h>	// yes after the others
@@ -34,10 +38,27 @@
 #include "genz_device.h"
 
 #include "fee.h"
+#include "fee_trace.h"
 #include "gf_bridge.h"
+#include "gf_bridge_ioctl.h"
 
 #define __UNUSED__ __attribute__ ((unused))
 
+// uring_cmd showed up in 5.19; its header and payload accessor moved.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define GF_BRIDGE_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define GF_URING_CMD_PAYLOAD(c)	io_uring_sqe_cmd((c)->sqe)
+#else
+#define GF_URING_CMD_PAYLOAD(c)	((c)->cmd)
+#endif
+#endif
+
 MODULE_LICENSE("GPL");
 MODULE_VERSION(GFBRIDGE_VERSION);
 MODULE_AUTHOR("Rocky Craig <rocky.craig@hpe.com>");
@@ -53,8 +74,6 @@ int onlySlot = 0;	// 0 == all
 module_param(onlySlot, uint, 0644);
 MODULE_PARM_DESC(onlySlot, "bind driver to this slot (0 == all)");
 
-DECLARE_WAIT_QUEUE_HEAD(bridge_reader_wait);
-
 //-------------------------------------------------------------------------
 // misc_register sets up a "hooking" fops for the first open call.  It
 // extracts its misdevice, puts it in file->private, then install the real
@@ -63,7 +82,8 @@ DECLARE_WAIT_QUEUE_HEAD(bridge_reader_wait);
 static int gf_bridge_open(struct inode *inode, struct file *file)
 {
 	struct FEE_adapter *adapter;
-	int n, ret;
+	struct bridge_file *bf;
+	int n;
 
 	// FEE drivers must do this during open() whether they use
 	// the return value or not.  Later APIs need it.
@@ -72,213 +92,393 @@ static int gf_bridge_open(struct inode *inode, struct file *file)
 
 	// pr_info("bridge_open() file->private_data @ 0x%p\n", adapter);
 
-	// FIXME: got to come up with more 'local module' support for this.
-	// Just keep it single user for now.  This code was from an earlier
-	// incantation, the "file->private_data" voodoo is another way to
-	// do single open.  I may need this later.
-
-	ret = 0;
-	if ((n = atomic_add_return(1, &adapter->nr_users) == 1)) {
-		struct bridge_buffers *buffers;
-
-		if (!(buffers = kzalloc(sizeof(*buffers), GFP_KERNEL))) {
-			ret = -ENOMEM;
-			goto alldone;
-		}
-		if (!(buffers->wbuf = kzalloc(adapter->max_buflen, GFP_KERNEL))) {
-			kfree(buffers);
-			ret = -ENOMEM;
-			goto alldone;
-		}
-		mutex_init(&(buffers->wbuf_mutex));
-		adapter->outgoing = buffers;
-	} else {
-		pr_warn(GFBRSP "Sorry, just exclusive open() for now\n");
-		ret = -EBUSY;
-		goto alldone;
-	}
-
-	PR_V1("open: %d users\n", atomic_read(&adapter->nr_users));
-
-alldone:
-	if (ret) 
-		atomic_dec(&adapter->nr_users);
-	return ret;
-}
-
-//-------------------------------------------------------------------------
-// At any close of a process fd
-
-static int gf_bridge_flush(struct file *file, fl_owner_t id)
-{
-	struct FEE_adapter *adapter = file->private_data;
-	int nr_users, f_count;
-
-	spin_lock(&file->f_lock);
-	nr_users = atomic_read(&adapter->nr_users);
-	f_count = atomic_long_read(&file->f_count);
-	spin_unlock(&file->f_lock);
-	if (f_count == 1) {
-		atomic_dec(&adapter->nr_users);
-		nr_users--;
-	}
-
-	PR_V1("flush: after (optional) dec: %d users, file count = %d\n",
-		nr_users, f_count);
-	
+	// Any number of openers.  Everything per-open lives in bridge_file;
+	// sends reserve space on the stack of the caller and receivers share
+	// the adapter queue, one message to one reader.
+	if (!(bf = kzalloc(sizeof(*bf), GFP_KERNEL)))
+		return -ENOMEM;
+	bf->adapter = adapter;
+	bf->mode = GF_BRIDGE_MODE_ASCII;
+	bf->busy_poll_usecs = GF_BRIDGE_BUSYPOLL_ADAPTER;
+	file->private_data = bf;
+	file->f_mode |= FMODE_NOWAIT;	// preadv2/pwritev2(RWF_NOWAIT)
+
+	n = atomic_inc_return(&adapter->nr_users);
+	PR_V1("open: %d users\n", n);
 	return 0;
 }
 
 //-------------------------------------------------------------------------
-// Only at the final close of the last process fd
+// Only at the final close of each open file (dup/fork share one).
 
 static int gf_bridge_release(struct inode *inode, struct file *file)
 {
-	struct FEE_adapter *adapter = file->private_data;
-	struct bridge_buffers *buffers = adapter->outgoing;
-	int nr_users, f_count;
-
-	spin_lock(&file->f_lock);
-	nr_users = atomic_read(&adapter->nr_users);
-	f_count = atomic_long_read(&file->f_count);
-	spin_unlock(&file->f_lock);
-	PR_V1("release: %d users, file count = %d\n", nr_users, f_count);
-	BUG_ON(nr_users);
-	kfree(buffers->wbuf);
-	kfree(buffers);
-	adapter->outgoing = NULL;
+	struct bridge_file *bf = file->private_data;
+	struct FEE_adapter *adapter = bf->adapter;
+	int nr_users;
+
+	nr_users = atomic_dec_return(&adapter->nr_users);
+	PR_V1("release: %d users remain\n", nr_users);
+	kfree(bf);
 	return 0;
 }
 
 //-------------------------------------------------------------------------
 // Prepend the sender id as a field separated by a colon, realized by two
-// calls to copy_to_user and avoiding a temporary buffer here. copy_to_user
-// can sleep and returns the number of bytes that could NOT be copied or
-// -ERRNO.  Require both copies to work all the way.  
+// copies into the iter and avoiding a temporary buffer here.  Require
+// both copies to work all the way.  readv() scatters across the iovecs.
+// A blocking receive busy-polls first if this fd or the adapter asked
+// for it.
 
-static ssize_t gf_bridge_read(struct file *file, char __user *buf,
-				 size_t buflen, loff_t *ppos)
+static ssize_t bridge_recv(struct bridge_file *bf, unsigned mode,
+			   struct iov_iter *to, int nonblocking)
 {
-	struct FEE_adapter *adapter = file->private_data;
-	struct FEE_mailslot *sender;
-	int ret, n;
+	struct FEE_adapter *adapter = bf->adapter;
+	unsigned usecs = READ_ONCE(bf->busy_poll_usecs);
+	int hybrid = READ_ONCE(bf->busy_poll_flags) & GF_BRIDGE_BUSYPOLL_HYBRID;
+	struct FEE_rxmsg *msg;
+	ssize_t ret = 0;
+	int n;
 	// SID is 28 bits or 10 decimal digits; CID is 16 bits or 5 digits
 	// so make the buffer big enough.
 	char sidcidstr[32];
 
+	if (usecs == GF_BRIDGE_BUSYPOLL_ADAPTER) {
+		usecs = READ_ONCE(adapter->busy_poll_usecs);
+		hybrid = READ_ONCE(adapter->busy_poll_hybrid);
+	}
+	if (usecs && !nonblocking)
+		FEE_busy_poll(adapter, usecs, hybrid);
+
 	// A successful return needs cleanup via FEE_release_incoming().
-	sender = FEE_await_incoming(adapter, file->f_flags & O_NONBLOCK);
-	if (IS_ERR(sender))
-		return PTR_ERR(sender);
-	PR_V2(GFBRSP "wait finished, %llu bytes to read\n", sender->buflen);
+	msg = FEE_await_incoming(adapter, nonblocking);
+	if (IS_ERR(msg))
+		return PTR_ERR(msg);
+	PR_V2(GFBRSP "wait finished, %llu bytes to read\n", msg->buflen);
+
+	if (mode == GF_BRIDGE_MODE_BINARY) {
+		struct gf_bridge_msghdr hdr = {
+			.cid = msg->peer_CID,
+			.sid = msg->peer_SID,
+			.len = msg->buflen,
+		};
+
+		n = sizeof(hdr);
+		if (iov_iter_count(to) < msg->buflen + n) {
+			ret = -E2BIG;
+			goto read_complete;
+		}
+		if (copy_to_iter(&hdr, n, to) != n)
+			ret = -EFAULT;
+		goto read_body;
+	}
 
 	// Two parts to the response: first is the sender "CID,SID:".
 	// Omit  the [] brackets commonly seen in the spec, ala [CID,SID].
 	n = snprintf(sidcidstr, sizeof(sidcidstr) - 1,
-		"%llu,%llu:", sender->peer_CID, sender->peer_SID);
+		"%llu,%llu:", msg->peer_CID, msg->peer_SID);
 
-	if (n >= sizeof(sidcidstr) || buflen < sender->buflen + n - 1) {
+	if (n >= sizeof(sidcidstr) || iov_iter_count(to) < msg->buflen + n) {
 		ret = -E2BIG;
 		goto read_complete;
 	}
-	if ((ret = copy_to_user(buf, sidcidstr, n))) {
-		if (ret > 0) ret= -EFAULT;	// partial transfer
+	if (copy_to_iter(sidcidstr, n, to) != n)
+		ret = -EFAULT;
+
+read_body:	// The message body follows the colon or header
+	if (ret || copy_to_iter(msg->buf, msg->buflen, to) != msg->buflen) {
+		ret = -EFAULT;		// partial transfer
 		goto read_complete;
 	}
-
-	// The message body follows the colon of the previous snippet.
-	ret = copy_to_user(buf + (uint64_t)n, sender->buf, sender->buflen);
-	ret = !ret ? sender->buflen + n :
-		(ret > 0 ? -EFAULT : ret);
-	// Now it's either the length of the full responose or -ESOMETHING
-	if (ret > 0)
-		*ppos = 0;
+	ret = msg->buflen + n;
 
 read_complete:	// Whether I used it or not, let everything go
-	FEE_release_incoming(adapter);
+	trace_fee_bridge_read(adapter, msg->peer_CID, msg->peer_SID, ret);
+	FEE_release_incoming(adapter, msg);
+	return ret;
+}
+
+// O_NONBLOCK or preadv2(RWF_NOWAIT)/io_uring get -EAGAIN, not a wait.
+
+static ssize_t gf_bridge_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct bridge_file *bf = iocb->ki_filp->private_data;
+	ssize_t ret;
+
+	ret = bridge_recv(bf, bf->mode, to,
+			  (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+			  (iocb->ki_flags & IOCB_NOWAIT));
+	if (ret > 0)
+		iocb->ki_pos = 0;
 	return ret;
 }
 
 //-------------------------------------------------------------------------
-// Use many idiot checks.  Performance is not the issue here.  The data
-// might be binary (including unprintables and NULs), not just a C string.
+// Destination is everything before the first colon: "CID,SID", a keyword
+// for the switch, or "expert use" of a bare IVSHMSG peer id.
 
-static ssize_t gf_bridge_write(struct file *file, const char __user *buf,
-				  size_t buflen, loff_t *ppos)
+static int parse_destination(struct FEE_adapter *adapter, char *dest,
+			     int *CID, int *SID)
 {
-	struct FEE_adapter *adapter = file->private_data;
-	struct bridge_buffers *buffers = adapter->outgoing;
-	ssize_t successlen = buflen;
-	char *bufbody;
-	int ret, restarts, SID, CID;
-
-	if (buflen >= adapter->max_buflen - 1) {	// Paranoia on term NUL
-		PR_V1("buflen of %lu is too big\n", buflen);
-		return -E2BIG;
+	char *comma;
+	int ret;
+
+	*SID = GENZ_FEE_SID_CID_IS_PEER_ID;
+	if (STREQ(dest, "server") || STREQ(dest, "switch") ||
+	    STREQ(dest, "link") || STREQ(dest, "interface")) {
+		*CID = adapter->globals->server_id;
+		return 0;
 	}
-	mutex_lock(&buffers->wbuf_mutex);	// Multiuse of *file
-	if ((ret = copy_from_user(buffers->wbuf, buf, buflen))) {
-		if (ret > 0)
-			ret = -EFAULT;
-		goto unlock_return;
+	if ((comma = strchr(dest, ','))) {	// Want CID,SID
+		*comma = '\0';
+		if ((ret = kstrtoint(comma + 1, 0, SID)))
+			return ret;
 	}
-	// Even if it's not a string, this puts a bound on the strchr(':')
-	buffers->wbuf[buflen] = '\0';		
+	return kstrtoint(dest, 0, CID);
+}
 
-	// Split body into two pieces around the first colon: a proper string
-	// and whatever the real payload is (string or binary).
-	if (!(bufbody = strchr(buffers->wbuf, ':'))) {
-		pr_err(GFBR "no colon in \"%s\"\n", buffers->wbuf);
-		ret = -EBADMSG;
-		goto unlock_return;
+//-------------------------------------------------------------------------
+// The body (maybe binary, not just a C string) goes straight from the
+// user's iovecs into the reserved outgoing space, so writev() of header +
+// body needs no concatenation anywhere.  Length or -ERRNO.  With a
+// "deferred" bitmap the doorbell is left for flush_doorbells().
+
+static void flush_doorbells(struct FEE_adapter *adapter,
+			    unsigned long *deferred)
+{
+	unsigned long peer_id;
+
+	for_each_set_bit(peer_id, deferred, adapter->globals->nEvents) {
+		clear_bit(peer_id, deferred);
+		FEE_doorbell(adapter, peer_id);
 	}
-	*bufbody = '\0';	// chomp ':', now two NUL-terminated sections
-	bufbody++;
-	buflen -= (uint64_t)bufbody - (uint64_t)buffers->wbuf;
-
-	// SID and CID from varying input, including "expert use" of a peer id.
-
-	SID = GENZ_FEE_SID_CID_IS_PEER_ID;
-	if (STREQ(buffers->wbuf, "server") || STREQ(buffers->wbuf, "switch") ||
-	    STREQ(buffers->wbuf, "link") || STREQ(buffers->wbuf, "interface"))
-		CID = adapter->globals->server_id;
-	else {
-		char *comma = strchr(buffers->wbuf, ','); // Want CID,SID
-
-		if (comma) {
-			*comma = '\0';
-			if ((ret = kstrtoint(buffers->wbuf, 0, &CID)))
-				goto unlock_return;
-			if ((ret = kstrtoint(comma + 1, 0, &SID)))
-				goto unlock_return;
-		} else {	// Direct use of an IVSHMSG peer id
-			if ((ret = kstrtoint(buffers->wbuf, 0, &CID)))
-				goto unlock_return;
-		}
+}
+
+static int bridge_send(struct FEE_adapter *adapter, int CID, int SID,
+		       struct iov_iter *from, size_t buflen, int nonblocking,
+		       unsigned long *deferred)
+{
+	struct FEE_txmsg tx;
+	int ret, restarts = 0;
+
+	// Too big for one message, maybe not for pieces.  They ring their
+	// own doorbells, and may wait on receivers that haven't heard yet.
+	if (buflen >= adapter->max_buflen) {
+		if (deferred)
+			flush_doorbells(adapter, deferred);
+		ret = FEE_frag_send(adapter, CID, SID, from, buflen,
+				    nonblocking);
+		if (ret == -ERESTARTSYS)
+			ret = -ETIMEDOUT;
+		goto out;
 	}
 
-	// Length or -ERRNO.  If length matched, then all is well, but
-	// this final len is always shorter than the original length.  Some
-	// code (ie, "echo") will resubmit the partial if the count is
-	// short.  So lie about it to the caller.
-
-	restarts = 0;
-restart:
-	ret = FEE_create_outgoing(CID, SID, bufbody, buflen, adapter);
-	if (ret == -ERESTARTSYS) {	// spurious timeout
-		if (restarts++ < 2)
-			goto restart;
+	do {
+		if (restarts)
+			FEE_count(adapter, FEE_CNT_TX_RESTARTS, 1);
+		ret = FEE_reserve_outgoing(CID, SID, buflen, adapter,
+					   nonblocking || deferred, &tx);
+		if (ret == -EAGAIN && deferred && !nonblocking) {
+			// Receivers can't hand back space for messages
+			// they haven't been told about.
+			flush_doorbells(adapter, deferred);
+			ret = FEE_reserve_outgoing(CID, SID, buflen, adapter,
+						   0, &tx);
+		}
+	} while (ret == -ERESTARTSYS && restarts++ < 2); // spurious timeout
+	if (ret == -ERESTARTSYS)
 		ret = -ETIMEDOUT;
-	} else if (ret == buflen)
-		ret = successlen;
-	else if (ret >= 0)
-		ret = -EIO;	// partial transfer paranoia
+	if (ret)
+		goto out;
+	if (copy_from_iter(tx.buf, buflen, from) != buflen) {
+		FEE_abort_outgoing(adapter, &tx);
+		ret = -EFAULT;
+		goto out;
+	}
+	ret = FEE_commit_outgoing(adapter, &tx, !deferred);
+	if (deferred)
+		set_bit(tx.peer_id, deferred);
 
-unlock_return:
-	mutex_unlock(&buffers->wbuf_mutex);
+out:
+	trace_fee_bridge_write(adapter, CID, SID, ret);
 	return ret;
 }
 
+// Binary mode: a struct header, no text anywhere.
+
+static int binary_destination(struct FEE_adapter *adapter,
+			      struct gf_bridge_msghdr *hdr, int *CID, int *SID)
+{
+	if (hdr->flags & ~(GF_BRIDGE_MSG_PEER_ID | GF_BRIDGE_MSG_SWITCH))
+		return -EINVAL;
+	if (hdr->flags & GF_BRIDGE_MSG_SWITCH) {
+		*CID = adapter->globals->server_id;
+		*SID = GENZ_FEE_SID_CID_IS_PEER_ID;
+	} else {
+		*CID = hdr->cid;
+		*SID = hdr->flags & GF_BRIDGE_MSG_PEER_ID ?
+			GENZ_FEE_SID_CID_IS_PEER_ID : hdr->sid;
+	}
+	return 0;
+}
+
+//-------------------------------------------------------------------------
+// See gf_bridge_ioctl.h for the semantics.  Destinations are binary no
+// matter the fd mode.
+
+static long bridge_sendmmsg(struct bridge_file *bf,
+			    struct gf_bridge_sendmmsg __user *uarg,
+			    int nonblocking)
+{
+	struct FEE_adapter *adapter = bf->adapter;
+	struct gf_bridge_sendmmsg mm;
+	struct gf_bridge_sendmsg m, __user *umsgs;
+	struct iovec iovstack[UIO_FASTIOV], *iov;
+	struct iov_iter from;
+	unsigned long *deferred;
+	long ret = 0;
+	int i, CID, SID;
+
+	if (copy_from_user(&mm, uarg, sizeof(mm)))
+		return -EFAULT;
+	if (mm.flags & ~GF_BRIDGE_SEND_NOWAIT)
+		return -EINVAL;
+	nonblocking |= mm.flags & GF_BRIDGE_SEND_NOWAIT;
+	mm.nmsgs = min_t(uint32_t, mm.nmsgs, GF_BRIDGE_SENDMMSG_MAX);
+	umsgs = u64_to_user_ptr(mm.msgs);
+	if (!(deferred = kcalloc(BITS_TO_LONGS(adapter->globals->nEvents),
+				 sizeof(unsigned long), GFP_KERNEL)))
+		return -ENOMEM;
+
+	for (i = 0; i < mm.nmsgs; i++) {
+		if (copy_from_user(&m, &umsgs[i], sizeof(m))) {
+			ret = -EFAULT;
+			break;
+		}
+		iov = iovstack;
+		ret = import_iovec(ITER_SOURCE, u64_to_user_ptr(m.iov),
+				   m.iovlen, ARRAY_SIZE(iovstack), &iov, &from);
+		if (ret >= 0) {
+			if (!(ret = binary_destination(
+					adapter, &m.hdr, &CID, &SID)))
+				ret = bridge_send(adapter, CID, SID, &from,
+						  iov_iter_count(&from),
+						  nonblocking, deferred);
+			kfree(iov);
+		}
+		if (put_user((int32_t)ret, &umsgs[i].status)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (ret == -EAGAIN || ret == -ETIMEDOUT) {	// Out of room
+			i++;
+			break;
+		}
+	}
+	flush_doorbells(adapter, deferred);
+	kfree(deferred);
+	return i ? i : ret;
+}
+
+//-------------------------------------------------------------------------
+// Use many idiot checks.  Performance is not the issue for the ASCII
+// header, which is peeked from the iter into a small stack buffer.
+
+#define GFBR_MAX_DEST	32	// "CID,SID:" is at most 17
+
+static ssize_t bridge_write(struct FEE_adapter *adapter, unsigned mode,
+			    struct iov_iter *from, int nonblocking)
+{
+	size_t buflen, successlen = iov_iter_count(from);
+	struct gf_bridge_msghdr hdr;
+	struct iov_iter peek;
+	char dest[GFBR_MAX_DEST + 1], *colon;
+	int ret, SID, CID;
+
+	if (mode == GF_BRIDGE_MODE_BINARY) {
+		if (copy_from_iter(&hdr, sizeof(hdr), from) != sizeof(hdr))
+			return successlen < sizeof(hdr) ? -EBADMSG : -EFAULT;
+		if (hdr.len != iov_iter_count(from))
+			return -EBADMSG;
+		if ((ret = binary_destination(adapter, &hdr, &CID, &SID)))
+			return ret;
+		buflen = hdr.len;
+		goto send;
+	}
+
+	peek = *from;
+	buflen = copy_from_iter(dest, min(successlen, sizeof(dest) - 1), &peek);
+	dest[buflen] = '\0';
+
+	// Split into two pieces around the first colon: a proper string
+	// and whatever the real payload is (string or binary).
+	if (!(colon = strchr(dest, ':'))) {
+		pr_err(GFBR "no colon in \"%s\"\n", dest);
+		return -EBADMSG;
+	}
+	*colon = '\0';		// chomp ':'
+	iov_iter_advance(from, colon - dest + 1);
+	buflen = iov_iter_count(from);
+	if ((ret = parse_destination(adapter, dest, &CID, &SID)))
+		return ret;
+
+	// If length matched, then all is well, but this final len is always
+	// shorter than the original length.  Some code (ie, "echo") will
+	// resubmit the partial if the count is short.  So lie about it to
+	// the caller.
+send:
+	ret = bridge_send(adapter, CID, SID, from, buflen, nonblocking, NULL);
+	if (ret < 0)
+		return ret;
+	return ret == buflen ? successlen : -EIO; // partial transfer paranoia
+}
+
+static ssize_t gf_bridge_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct bridge_file *bf = iocb->ki_filp->private_data;
+
+	return bridge_write(bf->adapter, bf->mode, from,
+			    (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+			    (iocb->ki_flags & IOCB_NOWAIT));
+}
+
+//-------------------------------------------------------------------------
+// io_uring passthrough for sends: binary framing whatever the fd mode,
+// without the VFS write layers.  Completion is always inline.  uring_cmd
+// has no poll arming, so a send that would block gets -EAGAIN and io_uring
+// re-issues it from an io-wq worker that waits for space there.
+//
+// There is no receive here: a wait for traffic could hold a worker for
+// as long as the peer is quiet, one per outstanding receive.  IORING_OP_READ
+// (binary mode) is the asynchronous receive; FMODE_NOWAIT and .poll let
+// io_uring wait for POLLIN without a thread.  IORING_OP_WRITE does the
+// same with POLLOUT for senders that keep lots in flight.
+
+#ifdef GF_BRIDGE_URING_CMD
+
+static int gf_bridge_uring_cmd(struct io_uring_cmd *ioucmd,
+			       unsigned issue_flags)
+{
+	struct bridge_file *bf = ioucmd->file->private_data;
+	const struct gf_bridge_uring_cmd *cmd = GF_URING_CMD_PAYLOAD(ioucmd);
+	int nonblocking = issue_flags & IO_URING_F_NONBLOCK;
+	struct iov_iter iter;
+	struct iovec iov = {
+		.iov_base = u64_to_user_ptr(READ_ONCE(cmd->addr)),
+		.iov_len = READ_ONCE(cmd->len),
+	};
+
+	switch (ioucmd->cmd_op) {
+	case GF_BRIDGE_URING_SEND:
+		iov_iter_init(&iter, ITER_SOURCE, &iov, 1, iov.iov_len);
+		return bridge_write(bf->adapter, GF_BRIDGE_MODE_BINARY,
+				    &iter, nonblocking);
+	}
+	return -ENOTTY;
+}
+
+#endif
+
 //-------------------------------------------------------------------------
 // Callbacks on activity against /sys/devices/..../thisdev.  Note the brdev
 // has "core" field.
@@ -321,17 +521,81 @@ static ssize_t gf_bridge_sysfs_write(
 
 
 //-------------------------------------------------------------------------
-// Returning 0 will cause the caller (epoll/poll/select) to sleep.
+// Map the receive area: descriptor ring then payload buffers, see
+// gf_bridge_ioctl.h.  Payloads get used in place instead of read().
+
+static int gf_bridge_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct bridge_file *bf = file->private_data;
+	struct FEE_adapter *adapter = bf->adapter;
+
+	return FEE_rxq_mmap(adapter, vma);
+}
+
+static long gf_bridge_ioctl(struct file *file, unsigned cmd, unsigned long arg)
+{
+	struct bridge_file *bf = file->private_data;
+	struct FEE_adapter *adapter = bf->adapter;
+	struct gf_bridge_rxinfo rxinfo;
+	struct gf_bridge_busypoll bp;
+
+	switch (cmd) {
+	case GF_BRIDGE_IOC_RXINFO:
+		rxinfo.ndesc = adapter->rxq_ndesc;
+		rxinfo.nbufs = adapter->rxq_nbufs;
+		rxinfo.stride = adapter->rxq_stride;
+		rxinfo.bufoff = adapter->rxq_bufs - (char *)adapter->rxq_area;
+		rxinfo.maplen = adapter->rxq_maplen;
+		if (copy_to_user((void __user *)arg, &rxinfo, sizeof(rxinfo)))
+			return -EFAULT;
+		return 0;
+
+	case GF_BRIDGE_IOC_RXRELEASE:
+		if (READ_ONCE(adapter->rxq_owner) != file)
+			return -EPERM;	// Not the one that mapped it
+		return FEE_release_index(adapter, arg);
+
+	case GF_BRIDGE_IOC_SENDMMSG:
+		return bridge_sendmmsg(bf, (void __user *)arg,
+				       file->f_flags & O_NONBLOCK);
+
+	case GF_BRIDGE_IOC_SETMODE:
+		if (arg != GF_BRIDGE_MODE_ASCII && arg != GF_BRIDGE_MODE_BINARY)
+			return -EINVAL;
+		bf->mode = arg;
+		return 0;
+
+	case GF_BRIDGE_IOC_BUSYPOLL:
+		if (copy_from_user(&bp, (void __user *)arg, sizeof(bp)))
+			return -EFAULT;
+		if (bp.flags & ~GF_BRIDGE_BUSYPOLL_HYBRID ||
+		    (bp.usecs > FEE_BUSY_POLL_MAX_USECS &&
+		     bp.usecs != GF_BRIDGE_BUSYPOLL_ADAPTER))
+			return -EINVAL;
+		WRITE_ONCE(bf->busy_poll_flags, bp.flags);
+		WRITE_ONCE(bf->busy_poll_usecs, bp.usecs);
+		return 0;
+	}
+	return -ENOTTY;
+}
+
+//-------------------------------------------------------------------------
+// Returning 0 will cause the caller (epoll/poll/select) to sleep.  The
+// deliverer wakes incoming_slot_wqh one reader per message; doorbells,
+// local sends and the FEE outgoing watch wake outgoing_wqh.  Both are
+// plain wake_up()s so EPOLLEXCLUSIVE waiters get woken one at a time.
 
 static uint gf_bridge_poll(struct file *file, struct poll_table_struct *wait)
 {
-	struct FEE_adapter *adapter = file->private_data;
+	struct bridge_file *bf = file->private_data;
+	struct FEE_adapter *adapter = bf->adapter;
 	uint ret = 0;
 
-	poll_wait(file, &bridge_reader_wait, wait);
+	poll_wait(file, &adapter->incoming_slot_wqh, wait);
+	poll_wait(file, &adapter->outgoing_wqh, wait);
+	if (FEE_incoming_ready(adapter))
 		ret |= POLLIN | POLLRDNORM;
-	// FIXME encapsulate this better, it's really the purview of sendstring
-	if (!adapter->my_slot->buflen)
+	if (FEE_outgoing_ready(adapter))
 		ret |= POLLOUT | POLLWRNORM;
 	return ret;
 }
@@ -340,11 +604,18 @@ static uint gf_bridge_poll(struct file *file, struct poll_table_struct *wait)
 static const struct file_operations gf_bridge_fops = {
 	.owner =	THIS_MODULE,
 	.open =		gf_bridge_open,
-	.flush =	gf_bridge_flush,
 	.release =	gf_bridge_release,
-	.read =		gf_bridge_read,
-	.write =	gf_bridge_write,
+	.read_iter =	gf_bridge_read_iter,
+	.write_iter =	gf_bridge_write_iter,
 	.poll =		gf_bridge_poll,
+	.mmap =		gf_bridge_mmap,
+	.unlocked_ioctl = gf_bridge_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	.compat_ioctl =	compat_ptr_ioctl,
+#endif
+#ifdef GF_BRIDGE_URING_CMD
+	.uring_cmd =	gf_bridge_uring_cmd,
+#endif
 };
 
 static const struct bin_attribute gf_bridge_sysfs_helper = {
@@ -34,10 +34,12 @@
 
 #define GFBRIDGE_VERSION	GFBRIDGE_NAME " v0.1.0: gotta start somewhere"
 
-// Just write support for now.
-struct bridge_buffers {
-	char *wbuf;			// kmalloc(max_msglen)
-	struct mutex wbuf_mutex;
+// Per-open state, hung off file->private_data.
+struct bridge_file {
+	struct FEE_adapter *adapter;
+	unsigned mode;			// GF_BRIDGE_MODE_xxx
+	unsigned busy_poll_usecs,	// GF_BRIDGE_BUSYPOLL_ADAPTER or own
+		 busy_poll_flags;
 };
 
 //-------------------------------------------------------------------------
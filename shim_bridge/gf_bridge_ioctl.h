@@ -0,0 +1,149 @@
+/*
+ * (C) Copyright 2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This source code file is part of the EmerGen-Z project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// User-visible interface of the bridge character device beyond plain
+// read()/write().  Include this from user space as-is.
+
+#ifndef GENZFEE_BRIDGE_IOCTL_DOT_H
+#define GENZFEE_BRIDGE_IOCTL_DOT_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define GF_BRIDGE_IOC_MAGIC	'Z'
+
+//-------------------------------------------------------------------------
+// mmap() of the receive area.  Offset 0 of the mapping is a descriptor
+// ring, followed (at rxinfo.bufoff) by the receive queue payload buffers,
+// "stride" bytes apart.  While mapped, incoming messages are posted to the
+// ring instead of being handed to read().  The kernel advances prod after
+// filling a descriptor; user space reads the descriptors in order, uses
+// each payload in place and returns the buffer with
+// GF_BRIDGE_IOC_RXRELEASE(desc.index), which moves cons past that
+// descriptor.  Buffers not handed back are not reused, so the ring can
+// never overflow.  poll() compares prod and cons.  The mapping is read
+// only (PROT_READ, no PROT_WRITE) since the kernel parses some buffers
+// after they're filled.
+// Messages bigger than a mailslot (sent in pieces, see below) don't fit a
+// buffer; they only go to read() and are dropped while the area is mapped.
+
+struct gf_bridge_rxdesc {
+	__u32 index,			// Receive buffer, for RXRELEASE
+	      buflen;			// Payload is NUL-terminated too
+	__u64 cid, sid;			// Sender
+};
+
+struct gf_bridge_rxring {
+	__u32 prod, pad1[15];		// Kernel writes
+	__u32 cons, pad2[15];		// Kernel writes, on RXRELEASE
+	struct gf_bridge_rxdesc desc[];	// ndesc, a power of 2
+};
+
+struct gf_bridge_rxinfo {
+	__u32 ndesc,			// Ring size
+	      nbufs,			// Receive buffers
+	      stride,			// Between buffers
+	      bufoff;			// Of buffer 0 from start of mapping
+	__u64 maplen;			// mmap() exactly this much
+};
+
+//-------------------------------------------------------------------------
+// Binary framing, selected per fd with GF_BRIDGE_IOC_SETMODE.  Each write()
+// is one header plus exactly hdr.len payload bytes; each read() returns one
+// header (the sender in cid/sid) plus the payload.  The default ASCII mode
+// ("CID,SID:payload") stays for echo and cat.
+//
+// In either mode a payload too big for one mailslot goes out in pieces to
+// a peer whose driver puts them back together (up to its frag_max_mb);
+// the reader sees one message.  Anybody else gets E2BIG as before.
+
+#define GF_BRIDGE_MODE_ASCII	0
+#define GF_BRIDGE_MODE_BINARY	1
+
+#define GF_BRIDGE_MSG_PEER_ID	(1 << 0)	// cid is a raw IVSHMSG peer id
+#define GF_BRIDGE_MSG_SWITCH	(1 << 1)	// To the switch, ignore cid/sid
+
+struct gf_bridge_msghdr {
+	__u32 cid, sid,
+	      flags,			// GF_BRIDGE_MSG_xxx
+	      len;			// Payload bytes that follow
+};
+
+//-------------------------------------------------------------------------
+// Batched send, sendmmsg() style.  Each entry is a binary header (len is
+// ignored, the iovecs say how much) and the iovecs holding the payload.
+// Entries go in order, each getting bytes sent or -errno in status.  A bad
+// entry doesn't stop the batch but running out of send space does (with
+// GF_BRIDGE_SEND_NOWAIT or O_NONBLOCK, else it waits).  Returns how many
+// entries have a status.  One doorbell per destination covers the batch.
+
+#define GF_BRIDGE_SEND_NOWAIT	(1 << 0)
+#define GF_BRIDGE_SENDMMSG_MAX	1024		// Entries per call
+
+struct gf_bridge_sendmsg {
+	struct gf_bridge_msghdr hdr;
+	__u64 iov;			// const struct iovec *
+	__u32 iovlen;
+	__s32 status;			// Out
+};
+
+struct gf_bridge_sendmmsg {
+	__u64 msgs;			// struct gf_bridge_sendmsg *
+	__u32 nmsgs,			// Capped at GF_BRIDGE_SENDMMSG_MAX
+	      flags;			// GF_BRIDGE_SEND_xxx
+};
+
+//-------------------------------------------------------------------------
+// io_uring IORING_OP_URING_CMD: cmd_op is GF_BRIDGE_URING_xxx and the SQE
+// command area holds this.  The buffer is one binary-framed message (see
+// struct gf_bridge_msghdr) regardless of the fd mode; cqe.res is the
+// framed length or -errno.  Receive with IORING_OP_READ in binary mode,
+// which waits on poll instead of a kernel thread.
+
+#define GF_BRIDGE_URING_SEND	1	// 2 was a receive, don't reuse it
+
+struct gf_bridge_uring_cmd {
+	__u64 addr;			// Header then payload
+	__u32 len,			// Of the buffer
+	      pad;
+};
+
+//-------------------------------------------------------------------------
+// Busy-poll for this fd, like SO_BUSY_POLL: a blocking read spins on the
+// sender mailslots for up to usecs before it sleeps.  HYBRID sleeps on an
+// hrtimer for part of the typical wait first.  usecs of
+// GF_BRIDGE_BUSYPOLL_ADAPTER goes back to the adapter default in sysfs
+// (.../fee/busy_poll_usecs and busy_poll_hybrid); 0 turns it off.
+
+#define GF_BRIDGE_BUSYPOLL_HYBRID	(1 << 0)
+#define GF_BRIDGE_BUSYPOLL_ADAPTER	(~0U)
+
+struct gf_bridge_busypoll {
+	__u32 usecs,			// Capped at 10000
+	      flags;			// GF_BRIDGE_BUSYPOLL_xxx
+};
+
+#define GF_BRIDGE_IOC_RXINFO	_IOR(GF_BRIDGE_IOC_MAGIC, 1, struct gf_bridge_rxinfo)
+#define GF_BRIDGE_IOC_RXRELEASE	_IO(GF_BRIDGE_IOC_MAGIC, 2)	// arg: index
+#define GF_BRIDGE_IOC_SETMODE	_IO(GF_BRIDGE_IOC_MAGIC, 3)	// arg: MODE_xxx
+#define GF_BRIDGE_IOC_SENDMMSG	_IOW(GF_BRIDGE_IOC_MAGIC, 4, struct gf_bridge_sendmmsg)
+#define GF_BRIDGE_IOC_BUSYPOLL	_IOW(GF_BRIDGE_IOC_MAGIC, 5, struct gf_bridge_busypoll)
+
+#endif
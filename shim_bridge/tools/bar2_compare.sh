@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Same runs under each BAR2 mapping: reload genz_fee with bar2_map=0
+# (uncached), 1 (write-combining) and 2 (cached) and print what the
+# debugfs benchmarks say every time.  Run as root from a build tree (make).
+#
+#	tools/bar2_compare.sh [-b bytes] [-n count] [-p peer id] [insmod params]
+#
+# bar2bench (copies through the mapping, no peer needed) runs on every
+# adapter.  With -p each adapter also pingbenches that peer, whose own
+# mapping is whatever it was loaded with.  Anything left over goes to
+# insmod, e.g. loopback_peers=2 (where all three come out cached).
+#
+# Send rings, credits, the management channel and doorbell suppression
+# need atomic read-modify-writes in BAR2, which only the uncached mapping
+# guarantees.  Under 1 and 2 an adapter runs without them, one legacy
+# message at a time, so pingbench compares protocols as much as mappings.
+# Loopback adapters are plain memory and keep everything.
+
+set -u
+
+usage() {
+	echo "usage: $0 [-b bytes] [-n count] [-p peer id] [insmod params]" >&2
+	exit 1
+}
+
+BYTES=4096
+COUNT=10000
+PEER=
+while getopts b:n:p: OPT; do
+	case $OPT in
+	b)	BYTES=$OPTARG ;;
+	n)	COUNT=$OPTARG ;;
+	p)	PEER=$OPTARG ;;
+	*)	usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+cd "$(dirname "$0")/.." || exit 1
+[ -f genz_fee.ko ] || { echo "no genz_fee.ko here, run make" >&2; exit 1; }
+DEBUGFS=/sys/kernel/debug/genz_fee
+
+unload() {
+	rmmod fee_bridge 2>/dev/null
+	rmmod genz_fee 2>/dev/null
+}
+
+for MAP in 0 1 2; do
+	unload
+	insmod genz_fee.ko bar2_map=$MAP "$@" || exit 1
+	sleep 1		# Let the peer attribute exchange finish
+	for DEV in $DEBUGFS/*/; do
+		echo "== $(basename $DEV) bar2_map=$MAP"
+		echo "$BYTES $COUNT" > $DEV/bar2bench
+		cat $DEV/bar2bench
+		[ "$PEER" ] || continue
+		echo "$PEER $COUNT" > $DEV/pingbench
+		cat $DEV/pingbench
+	done
+done
+unload
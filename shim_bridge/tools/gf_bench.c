@@ -0,0 +1,432 @@
+// Data path benchmark for /dev/genz_fee_bridgeXX.  Run one "serve" on the
+// target node and the measurements on another; both sides use the binary
+// framing from gf_bridge_ioctl.h.
+//
+//	gf_bench -d /dev/genz_fee_bridge05 serve [-t readers]
+//	gf_bench -d /dev/genz_fee_bridge03 -p <peer id of server node>
+//		[-t threads] [-n msgs] [-s size] [-S maxsize] [-o json|csv]
+//		tput | lat | sweep
+//
+// tput:  every thread streams n messages one way, then the server is
+//	  asked how many arrived (lost ones are reported, not retried).
+// lat:   every thread keeps one PING outstanding; any reader may get any
+//	  echo back, the timestamp inside says when it left.
+// sweep: tput and lat at each power of two from the smallest message up
+//	  to -S, stopping early at the driver's largest (E2BIG).
+//
+// One JSON object (or CSV row) per result on stdout, so runs can be diffed.
+// make bench
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../gf_bridge_ioctl.h"
+
+#define BENCH_MAGIC	0x47466245	// "GFbE"
+
+enum bench_kind { BENCH_DATA = 1, BENCH_PING, BENCH_RESET, BENCH_QUERY };
+
+// Start of every payload; the rest is filler up to the message size.
+struct bench_hdr {
+	uint32_t magic, kind;
+	uint64_t sent_ns;		// Client clock, for PING
+	uint64_t rx_msgs, rx_bytes;	// Server counts, for QUERY
+};
+
+struct bench_msg {
+	struct gf_bridge_msghdr hdr;
+	struct bench_hdr bh;
+	char filler[];
+};
+
+#define MIN_SIZE	sizeof(struct bench_hdr)
+#define QUERY_TRIES	20		// 50 ms apart
+
+static char *device;
+static struct gf_bridge_msghdr dest = { .flags = GF_BRIDGE_MSG_PEER_ID };
+static int nthreads = 1, csv;
+static long nmsgs = 100000;
+static size_t msgsize = 64, maxsize = 1 << 20;
+
+void die(char *s) {
+	perror(s);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bridge_open(void)
+{
+	int fd;
+
+	if ((fd = open(device, O_RDWR)) == -1)
+		die(device);
+	if (ioctl(fd, GF_BRIDGE_IOC_SETMODE, GF_BRIDGE_MODE_BINARY))
+		die("GF_BRIDGE_IOC_SETMODE");
+	return fd;
+}
+
+static struct bench_msg *msg_alloc(size_t size)
+{
+	struct bench_msg *m;
+
+	if (!(m = calloc(1, sizeof(*m) + size)))
+		die("calloc");
+	return m;
+}
+
+// Payload of size bytes to hdr's destination.  -errno on failure.
+
+static int msg_send(int fd, struct bench_msg *m, struct gf_bridge_msghdr *to,
+		    uint32_t kind, size_t size)
+{
+	m->hdr = *to;
+	m->hdr.len = size;
+	m->bh.magic = BENCH_MAGIC;
+	m->bh.kind = kind;
+	if (write(fd, m, sizeof(m->hdr) + size) == -1)
+		return -errno;
+	return 0;
+}
+
+// Next bench message, skipping anybody else's traffic.
+
+static int msg_recv(int fd, struct bench_msg *m, size_t bufsize)
+{
+	ssize_t n;
+
+	do {
+		if ((n = read(fd, m, sizeof(m->hdr) + bufsize)) == -1)
+			return -errno;
+	} while (n < sizeof(m->hdr) + MIN_SIZE || m->bh.magic != BENCH_MAGIC);
+	return 0;
+}
+
+//-------------------------------------------------------------------------
+// Server: count DATA, echo PING, answer RESET and QUERY.  Readers share
+// the adapter queue so counts are global.
+
+static uint64_t served_msgs, served_bytes;
+
+static void *serve_thread(void *arg)
+{
+	struct bench_msg *m = msg_alloc(maxsize);
+	struct gf_bridge_msghdr from;
+	int n, fd = bridge_open();
+
+	while (1) {
+		if ((n = msg_recv(fd, m, maxsize)) == -E2BIG)
+			continue;	// Bigger than -S, the driver dropped it
+		if (n)
+			die("read");
+		from = (struct gf_bridge_msghdr){
+			.cid = m->hdr.cid, .sid = m->hdr.sid };
+		switch (m->bh.kind) {
+		case BENCH_DATA:
+			__atomic_add_fetch(&served_msgs, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&served_bytes, m->hdr.len,
+					   __ATOMIC_RELAXED);
+			break;
+		case BENCH_PING:
+			msg_send(fd, m, &from, BENCH_PING, m->hdr.len);
+			break;
+		case BENCH_RESET:
+			__atomic_store_n(&served_msgs, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&served_bytes, 0, __ATOMIC_RELAXED);
+			msg_send(fd, m, &from, BENCH_RESET, MIN_SIZE);
+			break;
+		case BENCH_QUERY:
+			m->bh.rx_msgs = __atomic_load_n(&served_msgs,
+							__ATOMIC_RELAXED);
+			m->bh.rx_bytes = __atomic_load_n(&served_bytes,
+							 __ATOMIC_RELAXED);
+			msg_send(fd, m, &from, BENCH_QUERY, MIN_SIZE);
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void serve(void)
+{
+	pthread_t tid;
+	int i;
+
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&tid, NULL, serve_thread, NULL))
+			die("pthread_create");
+	serve_thread(NULL);
+}
+
+//-------------------------------------------------------------------------
+// Control round trip from the main thread: only it is reading then.
+
+static void control(int fd, uint32_t kind, struct bench_hdr *reply)
+{
+	struct bench_msg *m = msg_alloc(maxsize);
+
+	if (msg_send(fd, m, &dest, kind, MIN_SIZE))
+		die("control write");
+	do {
+		if (msg_recv(fd, m, maxsize))
+			die("control read");
+	} while (m->bh.kind != kind);	// Leftovers from an interrupted run
+	if (reply)
+		*reply = m->bh;
+	free(m);
+}
+
+struct worker {
+	pthread_t tid;
+	int fd, ret;
+	size_t size;
+	long sent;
+	uint64_t *rtt;			// lat: nmsgs of them
+	long nrtt;
+};
+
+static void *tput_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct bench_msg *m = msg_alloc(w->size);
+	long i;
+
+	for (i = 0; i < nmsgs; i++) {
+		if ((w->ret = msg_send(w->fd, m, &dest, BENCH_DATA, w->size)))
+			break;
+		w->sent++;
+	}
+	free(m);
+	return NULL;
+}
+
+static void *lat_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct bench_msg *m = msg_alloc(w->size);
+	uint64_t now;
+	long i;
+
+	for (i = 0; i < nmsgs; i++) {
+		m->bh.sent_ns = now_ns();
+		if ((w->ret = msg_send(w->fd, m, &dest, BENCH_PING, w->size)))
+			break;
+		w->sent++;
+		do {
+			if ((w->ret = msg_recv(w->fd, m, w->size)))
+				goto out;
+		} while (m->bh.kind != BENCH_PING);
+		now = now_ns();
+		w->rtt[w->nrtt++] = now - m->bh.sent_ns;
+	}
+out:
+	free(m);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+//-------------------------------------------------------------------------
+// One JSON object or CSV row.  Latency fields are 0 for tput.
+
+static void report(const char *mode, size_t size, long sent, long rcvd,
+		   uint64_t bytes, uint64_t elapsed_ns, uint64_t *rtt, long nrtt,
+		   int err)
+{
+	static int header;
+	double secs = elapsed_ns / 1e9;
+	double mps = secs ? rcvd / secs : 0, mbps = secs ? bytes / secs / 1e6 : 0;
+	uint64_t min = 0, p50 = 0, p99 = 0, p999 = 0;
+	double avg = 0;
+	long i;
+
+	if (nrtt) {
+		qsort(rtt, nrtt, sizeof(*rtt), cmp_u64);
+		for (i = 0; i < nrtt; i++)
+			avg += rtt[i];
+		avg /= nrtt;
+		min = rtt[0];
+		p50 = rtt[nrtt * 500 / 1000];
+		p99 = rtt[nrtt * 990 / 1000];
+		p999 = rtt[nrtt * 999 / 1000];
+	}
+	if (csv) {
+		if (!header++)
+			printf("mode,size,threads,sent,rcvd,lost,secs,msgs_per_sec,"
+			       "MB_per_sec,rtt_min_ns,rtt_avg_ns,rtt_p50_ns,"
+			       "rtt_p99_ns,rtt_p999_ns,error\n");
+		printf("%s,%zu,%d,%ld,%ld,%ld,%.6f,%.0f,%.3f,%" PRIu64 ",%.0f,%"
+		       PRIu64 ",%" PRIu64 ",%" PRIu64 ",%d\n",
+		       mode, size, nthreads, sent, rcvd, sent - rcvd, secs,
+		       mps, mbps, min, avg, p50, p99, p999, err);
+	} else {
+		printf("{\"mode\": \"%s\", \"size\": %zu, \"threads\": %d, "
+		       "\"sent\": %ld, \"rcvd\": %ld, \"lost\": %ld, "
+		       "\"secs\": %.6f, \"msgs_per_sec\": %.0f, "
+		       "\"MB_per_sec\": %.3f, \"rtt_min_ns\": %" PRIu64 ", "
+		       "\"rtt_avg_ns\": %.0f, \"rtt_p50_ns\": %" PRIu64 ", "
+		       "\"rtt_p99_ns\": %" PRIu64 ", \"rtt_p999_ns\": %" PRIu64 ", "
+		       "\"error\": %d}\n",
+		       mode, size, nthreads, sent, rcvd, sent - rcvd, secs,
+		       mps, mbps, min, avg, p50, p99, p999, err);
+	}
+	fflush(stdout);
+}
+
+// Both return 0 or the first -errno a worker hit (-E2BIG ends a sweep).
+
+static int run_tput(int ctlfd, size_t size)
+{
+	struct worker *w = calloc(nthreads, sizeof(*w));
+	struct bench_hdr counts;
+	uint64_t start, elapsed;
+	long sent = 0;
+	int i, tries, err = 0;
+
+	control(ctlfd, BENCH_RESET, NULL);
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		w[i].fd = bridge_open();
+		w[i].size = size;
+		if (pthread_create(&w[i].tid, NULL, tput_thread, &w[i]))
+			die("pthread_create");
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].tid, NULL);
+		close(w[i].fd);
+		sent += w[i].sent;
+		err = err ? : w[i].ret;
+	}
+
+	// The last few might still be in the server's queue.
+	for (tries = 0; tries < QUERY_TRIES; tries++) {
+		control(ctlfd, BENCH_QUERY, &counts);
+		elapsed = now_ns() - start;
+		if (counts.rx_msgs >= sent)
+			break;
+		usleep(50000);
+	}
+	report("tput", size, sent, counts.rx_msgs, counts.rx_bytes, elapsed,
+	       NULL, 0, err);
+	free(w);
+	return err;
+}
+
+static int run_lat(size_t size)
+{
+	struct worker *w = calloc(nthreads, sizeof(*w));
+	uint64_t start, elapsed, *rtt;
+	long sent = 0, nrtt = 0;
+	int i, err = 0;
+
+	if (!(rtt = malloc(nthreads * nmsgs * sizeof(*rtt))))
+		die("malloc");
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		w[i].fd = bridge_open();
+		w[i].size = size;
+		w[i].rtt = rtt + i * nmsgs;
+		if (pthread_create(&w[i].tid, NULL, lat_thread, &w[i]))
+			die("pthread_create");
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(w[i].tid, NULL);
+	elapsed = now_ns() - start;
+
+	// Compact the samples, then sort them all together.
+	for (i = 0; i < nthreads; i++) {
+		memmove(rtt + nrtt, w[i].rtt, w[i].nrtt * sizeof(*rtt));
+		nrtt += w[i].nrtt;
+		sent += w[i].sent;
+		close(w[i].fd);
+		err = err ? : w[i].ret;
+	}
+	report("lat", size, sent, nrtt, nrtt * size, elapsed, rtt, nrtt, err);
+	free(rtt);
+	free(w);
+	return err;
+}
+
+//-------------------------------------------------------------------------
+
+static void usage(char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s -d device [-p peer_id | -a CID,SID] [-t threads]\n"
+		"\t[-n msgs] [-s size] [-S maxsize] [-o json|csv]\n"
+		"\tserve | tput | lat | sweep\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	char *mode;
+	size_t size;
+	int opt, ctlfd;
+
+	while ((opt = getopt(argc, argv, "a:d:n:o:p:s:S:t:")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (sscanf(optarg, "%u,%u", &dest.cid, &dest.sid) != 2)
+				usage(argv[0]);
+			dest.flags = 0;
+			break;
+		case 'd': device = optarg; break;
+		case 'n': nmsgs = strtol(optarg, NULL, 0); break;
+		case 'o': csv = !strcmp(optarg, "csv"); break;
+		case 'p': dest.cid = strtoul(optarg, NULL, 0); break;
+		case 's': msgsize = strtoul(optarg, NULL, 0); break;
+		case 'S': maxsize = strtoul(optarg, NULL, 0); break;
+		case 't': nthreads = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (!device || optind != argc - 1 || nthreads < 1 || nmsgs < 1)
+		usage(argv[0]);
+	if (msgsize < MIN_SIZE)
+		msgsize = MIN_SIZE;
+	if (maxsize < msgsize)
+		maxsize = msgsize;
+	mode = argv[optind];
+
+	if (!strcmp(mode, "serve")) {
+		serve();
+		return 0;
+	}
+	if (!dest.cid)
+		usage(argv[0]);
+	ctlfd = bridge_open();
+
+	if (!strcmp(mode, "tput"))
+		return !!run_tput(ctlfd, msgsize);
+	if (!strcmp(mode, "lat"))
+		return !!run_lat(msgsize);
+	if (strcmp(mode, "sweep"))
+		usage(argv[0]);
+
+	// The header is the smallest, then 64, 128, ...
+	for (size = MIN_SIZE; size <= maxsize; size = size < 64 ? 64 : size * 2)
+		if (run_tput(ctlfd, size) == -E2BIG || run_lat(size) == -E2BIG)
+			break;
+	return 0;
+}
@@ -67,4 +67,51 @@ struct genz_interface_structure {
 		 PeerState;
 };
 
+// Link-layer messages between components.  The ASCII forms spoken by the
+// Python switch (ivshmsg_requests.py) have these binary equivalents for
+// peers that both understand them.  A NUL first byte can't start an ASCII
+// message so the two never get confused.
+
+#define GENZ_LINK_MAGIC		0x4c5a4700	// "\0GZL" in memory (LE)
+#define GENZ_LINK_VERSION	1
+
+enum genz_link_opcode {
+	GENZ_LINK_PING = 1,		// Proof of life, no payload
+	GENZ_LINK_PONG,			// Answer to PING, no payload
+	GENZ_LINK_PEER_ATTRIBUTE,	// "Link CTL Peer-Attribute", no payload
+	GENZ_LINK_PEER_ATTRIBUTE_ACK,	// "Link CTL ACK ..."
+	GENZ_LINK_CTL_WRITE_CID_SID,	// "CTL-Write Space=0,..."
+	GENZ_LINK_STANDALONE_ACK,	// "Standalone Acknowledgment ..."
+	GENZ_LINK_NOPCODES
+};
+
+struct __attribute__ ((packed)) genz_link_header_format {
+	uint32_t magic;			// GENZ_LINK_MAGIC
+	uint8_t version,		// GENZ_LINK_VERSION
+		opcode;			// enum genz_link_opcode
+	uint16_t reserved;
+};
+
+struct __attribute__ ((packed)) genz_link_peer_attribute_ack_format {
+	struct genz_link_header_format hdr;
+	char C_Class[32];		// NUL-terminated
+	int32_t CID0, SID0;
+};
+
+struct __attribute__ ((packed)) genz_link_ctl_write_cid_sid_format {
+	struct genz_link_header_format hdr;
+	uint32_t Space;			// Only 0 so far
+	int32_t PFMCID, PFMSID, CID, SID;
+	uint32_t Tag;
+};
+
+enum genz_link_reason {
+	GENZ_LINK_REASON_OK = 0,
+};
+
+struct __attribute__ ((packed)) genz_link_standalone_ack_format {
+	struct genz_link_header_format hdr;
+	uint32_t Tag, Reason;		// enum genz_link_reason
+};
+
 #endif